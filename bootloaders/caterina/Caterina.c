@@ -94,6 +94,20 @@ static uint32_t CurrAddress;
  */
 static bool RunBootloader = true;
 
+#if defined(LAZY_CHIP_ERASE)
+/** Bitmap of application pages that the host has asked to be erased with the 'e' command, and that have not
+ *  been erased or rewritten since. Pages still marked when the bootloader exits (or when flash is read back)
+ *  are erased then, so pages that are rewritten anyway are only erased once. Page 0 is never marked, as 'e'
+ *  erases it straight away.
+ */
+static uint8_t PendingErase[(BOOT_START_ADDR / SPM_PAGESIZE + 7) / 8];
+#endif
+
+#if defined(UPLOAD_STATS)
+/** Upload counters, returned to the host by the 'i' command. */
+static UploadStats_t UploadStats;
+#endif
+
 /* Pulse generation counters to keep track of the time remaining for each pulse type */
 #define TX_RX_LED_PULSE_PERIOD 100
 uint16_t TxLEDPulse = 0; // time remaining for Tx LED pulse
@@ -106,10 +120,71 @@ uint16_t Timeout = 0;
 static const uint16_t bootKey = 0x7777;
 volatile uint16_t *const bootKeyPtr = (volatile uint16_t *)0x0800;
 
+#if defined(FAST_BOOT_KEY_SUPPORT)
+/* A sketch that writes this value to bootKeyPtr asks for the next external reset to start it without the
+ * 750 ms double-tap delay.  The bootloader leaves bootKey set while the sketch starts, so the sketch should
+ * write fastBootKey again once it has been running for about 750 ms; a second reset before then still starts
+ * the bootloader. */
+static const uint16_t fastBootKey = 0xB007;
+#endif
+
+#if defined(BOOT_TIMING)
+/* Record of how long the boot took, left in RAM for the sketch.  See BootTiming_t in Caterina.h. */
+volatile BootTiming_t *const BootTimingPtr = (volatile BootTiming_t *)BOOT_TIMING_ADDR;
+
+/* High word of the boot timing clock: timer 3 overflows, counted by the overflow interrupt once interrupts
+ * are enabled and by BOOT_TIMING_POLL() in the delays before that. */
+static volatile uint16_t BootTimingOverflows;
+
+/** Counts a timer 3 overflow that hasn't been counted yet. Only called with interrupts disabled. */
+static void BootTimingPoll(void)
+{
+	if (TIFR3 & (1 << TOV3))
+	{
+		TIFR3 = (1 << TOV3);
+		BootTimingOverflows++;
+	}
+}
+
+/** Returns the time since the reset cause was read, in timer 3 counts.  An overflow that is still pending
+ *  belongs to this reading if it happened before TCNT3 was read, which it did if TCNT3 is in its lower half.
+ */
+static uint32_t BootTimingNow(void)
+{
+	uint8_t  SREGSave = SREG;
+	cli();
+
+	uint16_t Ticks     = TCNT3;
+	uint16_t Overflows = BootTimingOverflows;
+
+	if ((TIFR3 & (1 << TOV3)) && !(Ticks & 0x8000))
+	  Overflows++;
+
+	SREG = SREGSave;
+	return ((uint32_t)Overflows << 16) | Ticks;
+}
+
+#define BOOT_TIMING_STAMP(Field)  (BootTimingPtr->Field = BootTimingNow())
+#define BOOT_TIMING_POLL()        BootTimingPoll()
+#else
+#define BOOT_TIMING_STAMP(Field)
+#define BOOT_TIMING_POLL()
+#endif
+
 void StartSketch(void)
 {
 	cli();
 	
+	BOOT_TIMING_STAMP(StartSketch);
+
+	#if defined(BOOT_TIMING)
+	/* Put timer 3 back the way the reset left it */
+	TIMSK3 = 0;
+	TCCR3B = 0;
+	TCNT3 = 0;
+	TIFR3 = (1 << TOV3);
+	#endif
+
 	/* Undo TIMER1 setup and clear the count before running the sketch */
 	TIMSK1 = 0;
 	TCCR1B = 0;
@@ -159,6 +234,20 @@ int main(void)
 	/* Watchdog may be configured with a 15 ms period so must disable it before going any further */
 	wdt_disable();
 	
+	#if defined(BOOT_TIMING)
+	/* Time the rest of the boot with timer 3, which the bootloader doesn't otherwise use.  It starts at 1 so
+	 * that a milestone reached straight away doesn't read as not reached. */
+	TCNT3 = 1;
+	TIMSK3 = (1 << TOIE3);					// overflows are counted once interrupts are enabled
+	TCCR3B = (1 << CS31);					// 1/8 prescaler on timer 3 input
+	BootTimingPtr->Signature     = BOOT_TIMING_SIGNATURE;
+	BootTimingPtr->ResetCause    = mcusr_state;
+	BootTimingPtr->SetupHardware = 0;
+	BootTimingPtr->USBInit       = 0;
+	BootTimingPtr->FirstCommand  = 0;
+	BootTimingPtr->StartSketch   = 0;
+	#endif
+	BOOT_TIMING_STAMP(ResetDecoded);
 
 	if (pgm_read_word(0) != 0xFFFF)
 	{
@@ -179,7 +268,33 @@ int main(void)
 				// First reset button press. Set boot key for 750 ms so second reset button press
 				// can be detected, then start the sketch if there isn't another reset.
 				*bootKeyPtr = bootKey;
+				#if defined(FAST_BOOT_KEY_SUPPORT)
+				if (bootKeyPtrVal == fastBootKey)
+				{
+					// The sketch asked for fast boots, so it is responsible for clearing the boot key.
+					StartSketch();
+				}
+				#endif
+				#if defined(BOOT_WINDOW_EEPROM_ADDR)
+				// The double-tap window is stored in EEPROM in units of 10 ms, with 0xFF (erased)
+				// meaning the usual 750 ms.
+				uint8_t window = eeprom_read_byte((uint8_t *)BOOT_WINDOW_EEPROM_ADDR);
+				if (window == 0xFF)
+				  window = 75;
+				while (window--)
+				{
+					_delay_ms(10);
+					BOOT_TIMING_POLL();
+				}
+				#elif defined(BOOT_TIMING)
+				for (uint8_t window = 75; window; window--)
+				{
+					_delay_ms(10);
+					BOOT_TIMING_POLL();
+				}
+				#else
 				_delay_ms(750);
+				#endif
 				*bootKeyPtr = 0;
 				StartSketch();
 			}
@@ -221,6 +336,11 @@ int main(void)
 		LEDPulse();
 	}
 
+	#if defined(LAZY_CHIP_ERASE)
+	/* Finish a chip erase that was left to the end */
+	ErasePendingPages();
+	#endif
+
 	/* Disconnect from the host - USB interface will be reset later along with the AVR */
 	USB_Detach();
 
@@ -231,6 +351,8 @@ int main(void)
 /** Configures all hardware required for the bootloader. */
 void SetupHardware(void)
 {
+	BOOT_TIMING_STAMP(SetupHardware);
+
 	// This was in the original Caterina, but it shouldn't be necessary because we've already
 	// cleared WDRF and disabled the watchdog timer in main().
 	/* Disable watchdog if enabled by bootloader/fuses */
@@ -263,7 +385,17 @@ void SetupHardware(void)
 
 	/* Initialize USB Subsystem */
 	USB_Init();
+
+	BOOT_TIMING_STAMP(USBInit);
+}
+
+#if defined(BOOT_TIMING)
+/** ISR to count timer 3 overflows for the boot timing record. */
+ISR(TIMER3_OVF_vect, ISR_BLOCK)
+{
+	BootTimingOverflows++;
 }
+#endif
 
 //uint16_t ctr = 0;
 ISR(TIMER1_COMPA_vect, ISR_BLOCK)
@@ -294,11 +426,11 @@ void EVENT_USB_Device_ConfigurationChanged(void)
 
 	Endpoint_ConfigureEndpoint(CDC_TX_EPNUM, EP_TYPE_BULK,
 	                           ENDPOINT_DIR_IN, CDC_TXRX_EPSIZE,
-	                           ENDPOINT_BANK_SINGLE);
+	                           CDC_TXRX_EPBANKS);
 
 	Endpoint_ConfigureEndpoint(CDC_RX_EPNUM, EP_TYPE_BULK,
 	                           ENDPOINT_DIR_OUT, CDC_TXRX_EPSIZE,
-	                           ENDPOINT_BANK_SINGLE);
+	                           CDC_TXRX_EPBANKS);
 }
 
 /** Event handler for the USB_ControlRequest event. This is used to catch and process control requests sent to
@@ -342,6 +474,27 @@ void EVENT_USB_Device_ControlRequest(void)
 	}
 }
 
+/** Waits until the current SPM operation has completed. With UPLOAD_STATS, the time spent waiting is added to
+ *  the upload counters in timer 1 counts. The timer 1 ISR resets the count every millisecond, so the time is
+ *  summed from each reading of the count to the next.
+ */
+static void SpmBusyWait(void)
+{
+	#if defined(UPLOAD_STATS)
+	uint16_t LastCount = TCNT1;
+
+	while (boot_spm_busy())
+	{
+		uint16_t Count = TCNT1;
+
+		UploadStats.SpmBusyTicks += (Count >= LastCount) ? (Count - LastCount) : Count;
+		LastCount = Count;
+	}
+	#else
+	boot_spm_busy_wait();
+	#endif
+}
+
 #if !defined(NO_BLOCK_SUPPORT)
 /** Reads or writes a block of EEPROM or FLASH memory to or from the appropriate CDC data endpoint, depending
  *  on the AVR910 protocol command issued.
@@ -361,6 +514,26 @@ static void ReadWriteMemoryBlock(const uint8_t Command)
 
 	MemoryType =  FetchNextCommandByte();
 
+	#if defined(COMPRESSED_BLOCK_SUPPORT)
+	if ((Command == 'B') && (MemoryType == 'Z'))
+	{
+		/* Compressed FLASH page; BlockSize is the size of the compressed data */
+		WriteCompressedFlashPage(BlockSize);
+
+		return;
+	}
+	#endif
+
+	#if defined(DELTA_BLOCK_SUPPORT)
+	if ((Command == 'B') && (MemoryType == 'D'))
+	{
+		/* FLASH page given as a patch to the current FLASH contents; BlockSize is the size of the patch */
+		WriteDeltaFlashPage(BlockSize);
+
+		return;
+	}
+	#endif
+
 	if ((MemoryType != 'E') && (MemoryType != 'F'))
 	{
 		/* Send error byte back to the host */
@@ -376,6 +549,12 @@ static void ReadWriteMemoryBlock(const uint8_t Command)
 	/* Check if command is to read memory */
 	if (Command == 'g')
 	{		
+		#if defined(LAZY_CHIP_ERASE)
+		/* Pages that are still to be erased must read back blank */
+		if (MemoryType == 'F')
+		  ErasePendingPages();
+		#endif
+
 		/* Re-enable RWW section */
 		boot_rww_enable();
 
@@ -413,7 +592,52 @@ static void ReadWriteMemoryBlock(const uint8_t Command)
 		if (MemoryType == 'F')
 		{
 			boot_page_erase(PageStartAddress);
-			boot_spm_busy_wait();
+			SpmBusyWait();
+
+			#if defined(LAZY_CHIP_ERASE)
+			ClearPendingErase(PageStartAddress);
+			#endif
+
+			#if defined(HIGH_THROUGHPUT_CDC)
+			/* Drain whole words straight from the OUT endpoint bank into the page buffer, only going
+			 * through FetchNextCommandByte() to wait for the next packet or for a word that is split
+			 * across two packets */
+			while (BlockSize)
+			{
+				Endpoint_SelectEndpoint(CDC_RX_EPNUM);
+
+				uint8_t WordsInBank = (Endpoint_BytesInEndpoint() >> 1);
+
+				if (WordsInBank > (BlockSize >> 1))
+				  WordsInBank = (BlockSize >> 1);
+
+				if (WordsInBank)
+				{
+					BlockSize -= (WordsInBank << 1);
+
+					#if defined(UPLOAD_STATS)
+					UploadStats.BytesReceived += (WordsInBank << 1);
+					#endif
+
+					while (WordsInBank--)
+					{
+						boot_page_fill(CurrAddress, Endpoint_Read_16_LE());
+						CurrAddress += 2;
+					}
+				}
+				else
+				{
+					LowByte = FetchNextCommandByte();
+
+					if (--BlockSize)
+					{
+						boot_page_fill(CurrAddress, ((FetchNextCommandByte() << 8) | LowByte));
+						CurrAddress += 2;
+						BlockSize--;
+					}
+				}
+			}
+			#endif
 		}
 
 		while (BlockSize--)
@@ -439,7 +663,11 @@ static void ReadWriteMemoryBlock(const uint8_t Command)
 			else
 			{
 				/* Write the next EEPROM byte from the endpoint */
+				#if defined(FAST_EEPROM_WRITE)
+				WriteEEPROMByte(CurrAddress >> 1, FetchNextCommandByte());
+				#else
 				eeprom_write_byte((uint8_t*)((intptr_t)(CurrAddress >> 1)), FetchNextCommandByte());
+				#endif
 
 				/* Increment the address counter after use */
 				CurrAddress += 2;
@@ -452,9 +680,20 @@ static void ReadWriteMemoryBlock(const uint8_t Command)
 			/* Commit the flash page to memory */
 			boot_page_write(PageStartAddress);
 
+			#if defined(UPLOAD_STATS)
+			UploadStats.PagesWritten++;
+			#endif
+
 			/* Wait until write operation has completed */
-			boot_spm_busy_wait();
+			SpmBusyWait();
+		}
+		#if defined(FAST_EEPROM_WRITE)
+		else
+		{
+			/* Let the last EEPROM byte finish before the host can send a command that uses SPM */
+			eeprom_busy_wait();
 		}
+		#endif
 
 		/* Send response byte back to the host */
 		WriteNextResponseByte('\r');
@@ -465,6 +704,449 @@ static void ReadWriteMemoryBlock(const uint8_t Command)
 }
 #endif
 
+#if (defined(COMPRESSED_BLOCK_SUPPORT) || defined(DELTA_BLOCK_SUPPORT)) && !defined(NO_BLOCK_SUPPORT)
+/** RAM copy of the FLASH page being built by WriteCompressedFlashPage() or WriteDeltaFlashPage(). */
+static uint8_t PageBuffer[SPM_PAGESIZE];
+
+/** Writes the page in PageBuffer to the page at the current address, advances the address to the next page,
+ *  and sends the response byte back to the host.
+ */
+static void CommitPageBuffer(void)
+{
+	/* Disable timer 1 interrupt - can't afford to process nonessential interrupts
+	 * while doing SPM tasks */
+	TIMSK1 = 0;
+
+	boot_page_erase(CurrAddress);
+	SpmBusyWait();
+
+	#if defined(LAZY_CHIP_ERASE)
+	ClearPendingErase(CurrAddress);
+	#endif
+
+	for (uint8_t i = 0; i < SPM_PAGESIZE; i += 2)
+	  boot_page_fill(CurrAddress + i, (PageBuffer[i + 1] << 8) | PageBuffer[i]);
+
+	/* Commit the flash page to memory */
+	boot_page_write(CurrAddress);
+
+	#if defined(UPLOAD_STATS)
+	UploadStats.PagesWritten++;
+	#endif
+
+	/* Wait until write operation has completed */
+	SpmBusyWait();
+
+	CurrAddress += SPM_PAGESIZE;
+
+	/* Re-enable timer 1 interrupt disabled earlier in this routine */
+	TIMSK1 = (1 << OCIE1A);
+
+	/* Send response byte back to the host */
+	WriteNextResponseByte('\r');
+}
+#endif
+
+#if defined(COMPRESSED_BLOCK_SUPPORT) && !defined(NO_BLOCK_SUPPORT)
+
+/** Expands one compressed FLASH page from the CDC data endpoint and writes it to the page at the current
+ *  address, then advances the address to the next page. The compressed data is a sequence of tokens:
+ *
+ *  - 0x00-0x7F: a run of (token + 1) literal bytes, which follow the token.
+ *  - 0x80-0xBF: a back-reference of ((token & 0x3F) + 2) bytes, followed by one byte holding (distance - 1).
+ *  - 0xC0-0xFF: a back-reference of ((token & 0x3F) + 3) bytes, followed by the distance (1-65535) in two
+ *               bytes, high byte first.
+ *
+ *  A back-reference copies the bytes from that distance back, so a distance of 1 repeats the last byte. Bytes
+ *  before the start of the page are read from FLASH as it is, like the copies of WriteDeltaFlashPage(), so the
+ *  host should only refer back to pages it has already written. bootloaders/caterina/compress.py does this.
+ *
+ *  The tokens must expand to exactly one page. Otherwise, nothing is written and '?' is sent back to the host.
+ *
+ *  \param[in] BlockSize  Number of compressed bytes sent by the host
+ */
+static void WriteCompressedFlashPage(uint16_t BlockSize)
+{
+	uint8_t Position = 0;
+	bool    Valid    = true;
+
+	/* Make sure the RWW section can be read, for back-references before the page */
+	boot_rww_enable_safe();
+
+	while (BlockSize)
+	{
+		uint8_t  Token = FetchNextCommandByte();
+		uint8_t  Length;
+		uint16_t Distance = 0;
+
+		BlockSize--;
+
+		if ((Token & 0xC0) == 0xC0)
+		{
+			if (BlockSize < 2)
+			{
+				Valid = false;
+				break;
+			}
+
+			Length    = (Token & 0x3F) + 3;
+			Distance  = (FetchNextCommandByte() << 8);
+			Distance |=  FetchNextCommandByte();
+			BlockSize -= 2;
+
+			if (!(Distance))
+			{
+				/* Not a valid distance; skip the copy, and read on to the end of the block */
+				Valid  = false;
+				Length = 0;
+			}
+		}
+		else if (Token & 0x80)
+		{
+			if (!(BlockSize))
+			{
+				Valid = false;
+				break;
+			}
+
+			Length   = (Token & 0x3F) + 2;
+			Distance = FetchNextCommandByte() + 1;
+			BlockSize--;
+		}
+		else
+		{
+			Length = Token + 1;
+		}
+
+		while (Length--)
+		{
+			uint8_t Byte = 0;
+
+			if (Distance)
+			{
+				if (Distance <= Position)
+				{
+					Byte = PageBuffer[Position - Distance];
+				}
+				else if ((uint16_t)(Distance - Position) <= CurrAddress)
+				{
+					#if (FLASHEND > 0xFFFF)
+					Byte = pgm_read_byte_far(CurrAddress - (uint16_t)(Distance - Position));
+					#else
+					Byte = pgm_read_byte(CurrAddress - (uint16_t)(Distance - Position));
+					#endif
+				}
+				else
+				{
+					Valid = false;
+				}
+			}
+			else if (BlockSize)
+			{
+				Byte = FetchNextCommandByte();
+				BlockSize--;
+			}
+			else
+			{
+				Valid = false;
+			}
+
+			if (Position < SPM_PAGESIZE)
+			  PageBuffer[Position++] = Byte;
+			else
+			  Valid = false;
+		}
+	}
+
+	if (!(Valid) || (Position != SPM_PAGESIZE))
+	{
+		/* Send error byte back to the host */
+		WriteNextResponseByte('?');
+
+		return;
+	}
+
+	CommitPageBuffer();
+}
+#endif
+
+#if defined(DELTA_BLOCK_SUPPORT) && !defined(NO_BLOCK_SUPPORT)
+/** Builds one FLASH page from a patch against the current FLASH contents, read from the CDC data endpoint, and
+ *  writes it to the page at the current address, then advances the address to the next page. The host picks
+ *  the image to diff against by checking the CRC of the device's FLASH (see the 'z' command). The patch is a
+ *  sequence of operations:
+ *
+ *  - 0x00-0x7F: insert (op + 1) literal bytes, which follow the op.
+ *  - 0x80-0xFF: copy ((op & 0x7F) + 1) bytes from FLASH, starting at the 16-bit byte address that follows the
+ *               op (high byte first). The source is read before the page is erased, so it may be the page
+ *               itself.
+ *
+ *  Copies read FLASH as it is when the patch arrives, so a source in a page that an earlier patch of the same
+ *  update has already rewritten gives its new contents, not the old image's. bootloaders/delta.py makes
+ *  patches that allow for this.
+ *
+ *  The operations must produce exactly one page. Otherwise, nothing is written and '?' is sent back to the host.
+ *
+ *  \param[in] BlockSize  Number of patch bytes sent by the host
+ */
+static void WriteDeltaFlashPage(uint16_t BlockSize)
+{
+	uint8_t Position = 0;
+	bool    Valid    = true;
+
+	#if defined(LAZY_CHIP_ERASE)
+	/* Copies must see a chip erase that is still pending */
+	ErasePendingPages();
+	#endif
+
+	/* Make sure the RWW section can be read */
+	boot_rww_enable_safe();
+
+	while (BlockSize)
+	{
+		uint8_t  Op = FetchNextCommandByte();
+		uint8_t  Length = (Op & 0x7F) + 1;
+		uint16_t Source = 0;
+
+		BlockSize--;
+
+		if (Op & 0x80)
+		{
+			if (BlockSize < 2)
+			{
+				Valid = false;
+				break;
+			}
+
+			Source  = (FetchNextCommandByte() << 8);
+			Source |=  FetchNextCommandByte();
+			BlockSize -= 2;
+		}
+
+		while (Length--)
+		{
+			uint8_t Byte = 0;
+
+			if (Op & 0x80)
+			{
+				#if (FLASHEND > 0xFFFF)
+				Byte = pgm_read_byte_far(Source++);
+				#else
+				Byte = pgm_read_byte(Source++);
+				#endif
+			}
+			else if (BlockSize)
+			{
+				Byte = FetchNextCommandByte();
+				BlockSize--;
+			}
+			else
+			{
+				Valid = false;
+			}
+
+			if (Position < SPM_PAGESIZE)
+			  PageBuffer[Position++] = Byte;
+			else
+			  Valid = false;
+		}
+	}
+
+	if (!(Valid) || (Position != SPM_PAGESIZE))
+	{
+		/* Send error byte back to the host */
+		WriteNextResponseByte('?');
+
+		return;
+	}
+
+	CommitPageBuffer();
+}
+#endif
+
+#if defined(FAST_EEPROM_WRITE)
+/** Starts writing a byte to EEPROM without waiting for the write to finish, so that the next byte can be
+ *  fetched from the host while this one is being programmed. Bytes that already hold the given value are
+ *  skipped, and the erase or write half of the usual erase-and-write cycle is left out when it is not needed,
+ *  which halves the programming time and the wear on the cell.
+ *
+ *  The caller must wait for the last write to finish (e.g. with eeprom_busy_wait()) before using SPM.
+ *
+ *  \param[in] Address  EEPROM address to write to
+ *  \param[in] Data     Value to write
+ */
+static void WriteEEPROMByte(const uint16_t Address, const uint8_t Data)
+{
+	/* Wait for the previous byte to finish programming */
+	eeprom_busy_wait();
+
+	EEAR = Address;
+	EECR = (1 << EERE);
+
+	uint8_t OldData = EEDR;
+
+	if (OldData == Data)
+	  return;
+
+	if ((OldData & Data) == Data)
+	{
+		/* Only bits that need to be cleared: write only */
+		EECR = (1 << EEPM1);
+	}
+	else if (Data == 0xFF)
+	{
+		/* Only bits that need to be set: erase only */
+		EECR = (1 << EEPM0);
+	}
+	else
+	{
+		/* Erase and write in one operation */
+		EECR = 0;
+	}
+
+	EEDR = Data;
+
+	/* EEPE must be set within four cycles of EEMPE, so keep the USB interrupt out */
+	uint8_t CurrentGlobalInt = SREG;
+	cli();
+	EECR |= (1 << EEMPE);
+	EECR |= (1 << EEPE);
+	SREG = CurrentGlobalInt;
+}
+#endif
+
+#if defined(FAST_CHIP_ERASE) || defined(LAZY_CHIP_ERASE)
+/** Checks whether a FLASH page is already erased. The RWW section must be readable.
+ *
+ *  \param[in] PageAddress  Byte address of the start of the page
+ *
+ *  \return Boolean true if every byte of the page is 0xFF, false otherwise
+ */
+static bool IsPageBlank(const uint32_t PageAddress)
+{
+	for (uint16_t Offset = 0; Offset < SPM_PAGESIZE; Offset += 2)
+	{
+		#if (FLASHEND > 0xFFFF)
+		if (pgm_read_word_far(PageAddress + Offset) != 0xFFFF)
+		#else
+		if (pgm_read_word(PageAddress + Offset) != 0xFFFF)
+		#endif
+		  return false;
+	}
+
+	return true;
+}
+#endif
+
+#if defined(LAZY_CHIP_ERASE)
+/** Removes a page from the bitmap of pages waiting to be erased.
+ *
+ *  \param[in] PageAddress  Byte address of any location in the page
+ *
+ *  \return Boolean true if the page was waiting to be erased, false otherwise
+ */
+static bool ClearPendingErase(const uint32_t PageAddress)
+{
+	uint16_t Page = (PageAddress / SPM_PAGESIZE);
+	uint8_t  Mask = (1 << (Page & 0x07));
+
+	if (Page >= (BOOT_START_ADDR / SPM_PAGESIZE) || !(PendingErase[Page >> 3] & Mask))
+	  return false;
+
+	PendingErase[Page >> 3] &= ~Mask;
+
+	return true;
+}
+
+/** Erases every page still marked in the pending erase bitmap, skipping pages that are already blank, and
+ *  leaves the RWW section readable.
+ */
+static void ErasePendingPages(void)
+{
+	boot_rww_enable_safe();
+
+	for (uint32_t CurrFlashAddress = 0; CurrFlashAddress < BOOT_START_ADDR; CurrFlashAddress += SPM_PAGESIZE)
+	{
+		if (!(ClearPendingErase(CurrFlashAddress)) || IsPageBlank(CurrFlashAddress))
+		  continue;
+
+		boot_page_erase(CurrFlashAddress);
+		SpmBusyWait();
+		boot_rww_enable();
+
+		// Keep the control endpoint serviced so the host doesn't give up during a long erase
+		USB_USBTask();
+	}
+}
+#endif
+
+#if defined(SELF_PROGRAMMING_API)
+/* Jump table for sketches, placed at the end of the boot section by the makefile so that it doesn't move
+ * between builds. SelfProgramTable is also what keeps the linker from discarding it. */
+__asm__ (".section .apitable,\"ax\",@progbits\n"
+         ".global SelfProgramTable\n"
+         "SelfProgramTable:\n"
+         "	jmp SelfProgramErasePage\n"
+         "	jmp SelfProgramFillWord\n"
+         "	jmp SelfProgramWritePage\n"
+         ".previous\n");
+
+/** Erases a page of the application section for a sketch. Interrupts are kept disabled until the erase has
+ *  finished and the RWW section can be read again, since the sketch's vectors and code are in it.
+ *
+ *  \param[in] Address  Byte address of the page to erase
+ */
+void SelfProgramErasePage(const uint32_t Address)
+{
+	if (Address >= BOOT_START_ADDR)
+	  return;
+
+	uint8_t CurrentGlobalInt = SREG;
+	cli();
+
+	boot_page_erase_safe(Address);
+	boot_spm_busy_wait();
+	boot_rww_enable();
+
+	SREG = CurrentGlobalInt;
+}
+
+/** Loads a word into the FLASH page buffer for a sketch.
+ *
+ *  \param[in] Address  Byte address of the word
+ *  \param[in] Data     Word to load
+ */
+void SelfProgramFillWord(const uint32_t Address, const uint16_t Data)
+{
+	uint8_t CurrentGlobalInt = SREG;
+	cli();
+
+	boot_page_fill_safe(Address, Data);
+
+	SREG = CurrentGlobalInt;
+}
+
+/** Writes the FLASH page buffer to an erased page of the application section for a sketch. Interrupts are
+ *  kept disabled until the write has finished and the RWW section can be read again.
+ *
+ *  \param[in] Address  Byte address of the page to write
+ */
+void SelfProgramWritePage(const uint32_t Address)
+{
+	if (Address >= BOOT_START_ADDR)
+	  return;
+
+	uint8_t CurrentGlobalInt = SREG;
+	cli();
+
+	boot_page_write_safe(Address);
+	boot_spm_busy_wait();
+	boot_rww_enable();
+
+	SREG = CurrentGlobalInt;
+}
+#endif
+
 /** Retrieves the next byte from the host in the CDC data OUT endpoint, and clears the endpoint bank if needed
  *  to allow reception of the next data packet from the host.
  *
@@ -484,9 +1166,17 @@ static uint8_t FetchNextCommandByte(void)
 		{
 			if (USB_DeviceState == DEVICE_STATE_Unattached)
 			  return 0;
+
+			#if defined(UPLOAD_STATS)
+			UploadStats.EndpointWaits++;
+			#endif
 		}
 	}
 
+	#if defined(UPLOAD_STATS)
+	UploadStats.BytesReceived++;
+	#endif
+
 	/* Fetch the next byte from the OUT endpoint */
 	return Endpoint_Read_8();
 }
@@ -510,6 +1200,10 @@ static void WriteNextResponseByte(const uint8_t Response)
 		{
 			if (USB_DeviceState == DEVICE_STATE_Unattached)
 			  return;
+
+			#if defined(UPLOAD_STATS)
+			UploadStats.EndpointWaits++;
+			#endif
 		}
 	}
 
@@ -552,6 +1246,11 @@ void CDC_Task(void)
 	/* Read in the bootloader command (first byte sent from host) */
 	uint8_t Command = FetchNextCommandByte();
 
+	#if defined(BOOT_TIMING)
+	if (!(BootTimingPtr->FirstCommand))
+	  BOOT_TIMING_STAMP(FirstCommand);
+	#endif
+
 	if (Command == 'E')
 	{
 		/* We nearly run out the bootloader timeout clock, 
@@ -623,14 +1322,47 @@ void CDC_Task(void)
 	}
 	else if (Command == 'e')
 	{
+		#if defined(LAZY_CHIP_ERASE)
+		// Only mark the application section to be erased; pages written before the bootloader exits
+		// are erased by the write itself, and the rest by ErasePendingPages()
+		for (uint8_t i = 0; i < sizeof(PendingErase); i++)
+		  PendingErase[i] = 0xFF;
+
+		// Page 0 is erased now, since the bootloader only times out and starts the sketch while it is programmed
+		ClearPendingErase(0);
+		boot_page_erase(0);
+		SpmBusyWait();
+		boot_rww_enable();
+		#else
 		// Clear the application section of flash 
+		#if defined(FAST_CHIP_ERASE)
+		boot_rww_enable_safe();
+		#endif
 		for (uint32_t CurrFlashAddress = 0; CurrFlashAddress < BOOT_START_ADDR; CurrFlashAddress += SPM_PAGESIZE)
 		{
+			#if defined(FAST_CHIP_ERASE)
+			// Pages that are already blank don't need erasing
+			if (IsPageBlank(CurrFlashAddress))
+			  continue;
+			#endif
+
 			boot_page_erase(CurrFlashAddress);
-			boot_spm_busy_wait();
+			SpmBusyWait();
+
+			#if defined(FAST_CHIP_ERASE)
+			// The erase already leaves the page blank, so it is not followed by a page write
+
+			// Make the next page readable for the blank check
+			boot_rww_enable();
+
+			// Keep the control endpoint serviced so the host doesn't give up during a long erase
+			USB_USBTask();
+			#else
 			boot_page_write(CurrFlashAddress);
-			boot_spm_busy_wait();
+			SpmBusyWait();
+			#endif
 		}
+		#endif
 
 		// Send confirmation byte back to the host 
 		WriteNextResponseByte('\r');
@@ -678,6 +1410,48 @@ void CDC_Task(void)
 		ReadWriteMemoryBlock(Command);
 	}
 	#endif
+	#if defined(FLASH_CRC_SUPPORT)
+	else if (Command == 'z')
+	{
+		// Return the CRC-16/MODBUS (polynomial 0xA001 reflected, initial value 0xFFFF) of a block of
+		// flash, high byte first, so the host can verify an upload without reading it back.  Like 'g',
+		// this starts at the current address and leaves the address after the block.  A length of 0 is an
+		// empty block, whose CRC is 0xFFFF, as it is with Optiboot; bootloaders/crc16.py is the host reference.
+		uint16_t BlockSize;
+		uint16_t Crc = 0xFFFF;
+
+		BlockSize  = (FetchNextCommandByte() << 8);
+		BlockSize |=  FetchNextCommandByte();
+
+		#if defined(LAZY_CHIP_ERASE)
+		ErasePendingPages();
+		#endif
+
+		boot_rww_enable_safe();
+
+		while (BlockSize--)
+		{
+			#if (FLASHEND > 0xFFFF)
+			Crc = _crc16_update(Crc, pgm_read_byte_far(CurrAddress++));
+			#else
+			Crc = _crc16_update(Crc, pgm_read_byte(CurrAddress++));
+			#endif
+		}
+
+		WriteNextResponseByte(Crc >> 8);
+		WriteNextResponseByte(Crc & 0xFF);
+	}
+	#endif
+	#if defined(UPLOAD_STATS)
+	else if (Command == 'i')
+	{
+		// Send the upload counters in memory order, which is the same 16-byte layout as Optiboot's 'X' reply
+		const uint8_t* StatsByte = (const uint8_t*)&UploadStats;
+
+		for (uint8_t CurrByte = 0; CurrByte < sizeof(UploadStats); CurrByte++)
+		  WriteNextResponseByte(StatsByte[CurrByte]);
+	}
+	#endif
 	#if !defined(NO_FLASH_BYTE_SUPPORT)
 	else if (Command == 'C')
 	{
@@ -700,17 +1474,34 @@ void CDC_Task(void)
 	}
 	else if (Command == 'm')
 	{
+		#if defined(LAZY_CHIP_ERASE)
+		// The page buffer survives a page erase, so a page marked by 'e' can still be erased now
+		if (ClearPendingErase(CurrAddress))
+		{
+			boot_page_erase(CurrAddress);
+			SpmBusyWait();
+		}
+		#endif
+
 		// Commit the flash page to memory
 		boot_page_write(CurrAddress);
 
+		#if defined(UPLOAD_STATS)
+		UploadStats.PagesWritten++;
+		#endif
+
 		// Wait until write operation has completed 
-		boot_spm_busy_wait();
+		SpmBusyWait();
 
 		// Send confirmation byte back to the host 
 		WriteNextResponseByte('\r');
 	}
 	else if (Command == 'R')
 	{
+		#if defined(LAZY_CHIP_ERASE)
+		ErasePendingPages();
+		#endif
+
 		#if (FLASHEND > 0xFFFF)
 		uint16_t ProgramWord = pgm_read_word_far(CurrAddress);
 		#else
@@ -725,7 +1516,12 @@ void CDC_Task(void)
 	else if (Command == 'D')
 	{
 		// Read the byte from the endpoint and write it to the EEPROM 
+		#if defined(FAST_EEPROM_WRITE)
+		WriteEEPROMByte(CurrAddress >> 1, FetchNextCommandByte());
+		eeprom_busy_wait();
+		#else
 		eeprom_write_byte((uint8_t*)((intptr_t)(CurrAddress >> 1)), FetchNextCommandByte());
+		#endif
 
 		// Increment the address after use
 		CurrAddress += 2;
@@ -44,6 +44,9 @@
 		#include <avr/power.h>
 		#include <avr/interrupt.h>
 		#include <stdbool.h>
+		#if defined(FLASH_CRC_SUPPORT)
+			#include <util/crc16.h>
+		#endif
 
 		#include "Descriptors.h"
 
@@ -81,10 +84,48 @@
 			#define RX_LED_ON()		PORTB &= ~(1<<0)
 		#endif
 
+		#if defined(BOOT_TIMING)
+			/** RAM address of the boot timing record, just after the boot key. */
+			#define BOOT_TIMING_ADDR             0x0802
+
+			/** Value of BootTiming_t::Signature when the record was written by this bootloader. */
+			#define BOOT_TIMING_SIGNATURE        0x5442
+		#endif
+
 	/* Type Defines: */
 		/** Type define for a non-returning pointer to the start of the loaded application in flash memory. */
 		typedef void (*AppPtr_t)(void) ATTR_NO_RETURN;
 
+		#if defined(BOOT_TIMING)
+			/** Boot timing record, left at BOOT_TIMING_ADDR. Times are counts of timer 3 at 1/8 of the CPU clock
+			 *  (0.5 us at 16 MHz), with timer 3 overflows in the high word, counted from 1 just after the reset
+			 *  cause is read. A milestone that was not reached reads 0. The sketch's C runtime initializes this
+			 *  part of RAM, so a sketch has to copy the record from a function in .init3 or earlier.
+			 */
+			typedef struct
+			{
+				uint16_t Signature;     /**< BOOT_TIMING_SIGNATURE */
+				uint8_t  ResetCause;    /**< MCUSR as it was at reset */
+				uint32_t ResetDecoded;  /**< Reset cause decoded, before deciding whether to start the sketch */
+				uint32_t SetupHardware; /**< SetupHardware() entered */
+				uint32_t USBInit;       /**< USB_Init() returned */
+				uint32_t FirstCommand;  /**< First command received from the host */
+				uint32_t StartSketch;   /**< Jumping to the sketch */
+			} BootTiming_t;
+		#endif
+
+		#if defined(UPLOAD_STATS)
+			/** Upload counters returned by the 'i' command, sent in this order with each field little endian. */
+			typedef struct
+			{
+				uint32_t BytesReceived; /**< Bytes read from the CDC data OUT endpoint */
+				uint16_t PagesWritten;  /**< FLASH page writes */
+				uint32_t SpmBusyTicks;  /**< Time spent waiting for SPM, in timer 1 counts (1/64 of the CPU clock) */
+				uint32_t EndpointWaits; /**< Polls of a CDC data endpoint that found it not ready */
+				uint16_t FramingErrors; /**< Always 0 - USB has no framing errors, this keeps Optiboot's layout */
+			} UploadStats_t;
+		#endif
+
 	/* Function Prototypes: */
 		void StartSketch(void);
 		void LEDPulse(void);
@@ -94,10 +135,45 @@
 
 		void EVENT_USB_Device_ConfigurationChanged(void);
 
+		#if defined(SELF_PROGRAMMING_API)
+			/** Self-programming functions for sketches, reached through a table of JMP instructions in the
+			 *  last 12 bytes of the boot section (0x7FF4 on a 32 KB device):
+			 *
+			 *  - BOOT_END - 11: void SelfProgramErasePage(uint32_t Address)
+			 *  - BOOT_END - 7:  void SelfProgramFillWord(uint32_t Address, uint16_t Data)
+			 *  - BOOT_END - 3:  void SelfProgramWritePage(uint32_t Address)
+			 *
+			 *  Addresses are byte addresses, and pages at or above BOOT_START_ADDR are left alone.
+			 */
+			void SelfProgramErasePage(const uint32_t Address);
+			void SelfProgramFillWord(const uint32_t Address, const uint16_t Data);
+			void SelfProgramWritePage(const uint32_t Address);
+		#endif
+
 		#if defined(INCLUDE_FROM_CATERINA_C) || defined(__DOXYGEN__)
 			#if !defined(NO_BLOCK_SUPPORT)
 			static void    ReadWriteMemoryBlock(const uint8_t Command);
+			#if defined(COMPRESSED_BLOCK_SUPPORT) || defined(DELTA_BLOCK_SUPPORT)
+			static void    CommitPageBuffer(void);
+			#endif
+			#if defined(COMPRESSED_BLOCK_SUPPORT)
+			static void    WriteCompressedFlashPage(uint16_t BlockSize);
+			#endif
+			#if defined(DELTA_BLOCK_SUPPORT)
+			static void    WriteDeltaFlashPage(uint16_t BlockSize);
+			#endif
+			#endif
+			#if defined(FAST_CHIP_ERASE) || defined(LAZY_CHIP_ERASE)
+			static bool    IsPageBlank(const uint32_t PageAddress);
+			#endif
+			#if defined(LAZY_CHIP_ERASE)
+			static bool    ClearPendingErase(const uint32_t PageAddress);
+			static void    ErasePendingPages(void);
+			#endif
+			#if defined(FAST_EEPROM_WRITE)
+			static void    WriteEEPROMByte(const uint16_t Address, const uint8_t Data);
 			#endif
+			static void    SpmBusyWait(void);
 			static uint8_t FetchNextCommandByte(void);
 			static void    WriteNextResponseByte(const uint8_t Response);
 		#endif
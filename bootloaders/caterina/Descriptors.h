@@ -101,8 +101,19 @@
 		/** Endpoint number for the CDC data interface RX (data OUT) endpoint. */
 		#define CDC_RX_EPNUM                   4
 
-		/** Size of the CDC data interface TX and RX data endpoint banks, in bytes. */
-		#define CDC_TXRX_EPSIZE                16
+		#if defined(HIGH_THROUGHPUT_CDC)
+			/** Size of the CDC data interface TX and RX data endpoint banks, in bytes. */
+			#define CDC_TXRX_EPSIZE            64
+
+			/** Number of banks used by the CDC data interface TX and RX data endpoints. */
+			#define CDC_TXRX_EPBANKS           ENDPOINT_BANK_DOUBLE
+		#else
+			/** Size of the CDC data interface TX and RX data endpoint banks, in bytes. */
+			#define CDC_TXRX_EPSIZE            16
+
+			/** Number of banks used by the CDC data interface TX and RX data endpoints. */
+			#define CDC_TXRX_EPBANKS           ENDPOINT_BANK_SINGLE
+		#endif
 
 		/** Size of the CDC control interface notification endpoint bank, in bytes. */
 		#define CDC_NOTIFICATION_EPSIZE        8
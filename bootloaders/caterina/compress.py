@@ -0,0 +1,235 @@
+#!/usr/bin/env python3
+"""Compresses flash pages for Caterina's compressed block write.
+
+Caterina built with COMPRESSED_BLOCK_SUPPORT accepts a 'B' block write
+with memory type 'Z', holding one compressed 128-byte flash page as a
+sequence of tokens:
+
+    0x00-0x7f  (token + 1) literal bytes, which follow the token
+    0x80-0xbf  ((token & 0x3f) + 2) bytes copied from (next byte + 1)
+               bytes back
+    0xc0-0xff  ((token & 0x3f) + 3) bytes copied from the distance in the
+               next two bytes, high byte first
+
+A copy may overlap itself, and may reach back before the page into flash,
+which the bootloader reads as it is.  This script only refers back to
+pages written earlier in the same upload, in address order, so it does
+not depend on what the device held before.
+
+The tokens must make exactly one page.  This script compresses each page
+of the given .hex files, expands every page again the way the bootloader
+does, checks that it gets the page back, and prints how much smaller the
+upload is.  The parse is optimal over the matches it looks at: every copy
+within 256 bytes, and the MAX_CANDIDATES nearest earlier places where the
+next three bytes appear.
+
+With one input, --output writes the pages to a file, each as:
+
+    uint16  byte address of the page, high byte first
+    uint8   'Z' for a compressed page or 'F' for a plain one
+    uint8   number of bytes that follow
+    ...     the compressed or plain page
+
+A page is sent plain where compressing it would not make it smaller.
+
+    python3 compress.py Caterina-A-Star.hex ../optiboot/*.hex
+"""
+
+import argparse
+import struct
+import sys
+
+PAGE_SIZE = 128
+MAX_LITERALS = 128
+MAX_NEAR_COPY = 65
+MAX_NEAR_DISTANCE = 256
+MAX_FAR_COPY = 66
+MAX_FAR_DISTANCE = 0xFFFF
+MAX_CANDIDATES = 256
+
+
+def read_hex(path):
+    """Returns {address: byte} for the data in a .hex file."""
+    data = {}
+    base = 0
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if not line.startswith(':'):
+                continue
+            rec = bytes.fromhex(line[1:])
+            if sum(rec) & 0xFF:
+                raise ValueError('%s: bad checksum' % path)
+            count, addr, kind = rec[0], rec[1] << 8 | rec[2], rec[3]
+            if kind == 0:
+                for i in range(count):
+                    data[base + addr + i] = rec[4 + i]
+            elif kind == 2:
+                base = (rec[4] << 8 | rec[5]) << 4
+            elif kind == 4:
+                base = (rec[4] << 8 | rec[5]) << 16
+            elif kind == 1:
+                break
+    return data
+
+
+def pages(data):
+    """Yields (address, page) for every page the image has data in, with
+    0xff where it has none, as avrdude would write them."""
+    for addr in sorted({a - a % PAGE_SIZE for a in data}):
+        yield addr, bytes(data.get(addr + i, 0xFF) for i in range(PAGE_SIZE))
+
+
+def compress(page, history=b''):
+    """Returns the shortest token sequence that expands to page, where
+    history is the flash just before the page, as the device will hold it
+    when the page arrives."""
+    history = bytes(history[-MAX_FAR_DISTANCE:])
+    text = history + bytes(page)
+    base = len(history)
+    n = len(page)
+
+    # Where each three bytes start in text, nearest last
+    index = {}
+    for p in range(len(text) - 2):
+        index.setdefault(text[p:p + 3], []).append(p)
+
+    def match(src, i, limit):
+        length = 0
+        while length < limit and text[src + length] == page[i + length]:
+            length += 1
+        return length
+
+    # cost[i] and choice[i]: the cheapest encoding of page[i:], and its first
+    # token as (literal count, 0, 1) or (copy length, distance, token size)
+    cost = [0] * (n + 1)
+    choice = [None] * n
+    for i in range(n - 1, -1, -1):
+        best = None
+        for length in range(1, min(MAX_LITERALS, n - i) + 1):
+            c = 1 + length + cost[i + length]
+            if best is None or c < best:
+                best, choice[i] = c, (length, 0, 1)
+        here = base + i
+        for distance in range(1, min(MAX_NEAR_DISTANCE, here) + 1):
+            length = match(here - distance, i, min(MAX_NEAR_COPY, n - i))
+            for l in range(2, length + 1):
+                c = 2 + cost[i + l]
+                if c < best:
+                    best, choice[i] = c, (l, distance, 2)
+        candidates = index.get(text[here:here + 3], [])
+        tried = 0
+        for src in reversed(candidates):
+            if src >= here:
+                continue
+            if here - src > MAX_FAR_DISTANCE or tried == MAX_CANDIDATES:
+                break
+            tried += 1
+            length = match(src, i, min(MAX_FAR_COPY, n - i))
+            for l in range(3, length + 1):
+                c = 3 + cost[i + l]
+                if c < best:
+                    best, choice[i] = c, (l, here - src, 3)
+        cost[i] = best
+
+    out = bytearray()
+    i = 0
+    while i < n:
+        length, distance, size = choice[i]
+        if not distance:
+            out.append(length - 1)
+            out += page[i:i + length]
+        elif size == 2:
+            out += bytes((0x80 | (length - 2), distance - 1))
+        else:
+            out += bytes((0xC0 | (length - 3), distance >> 8, distance & 0xFF))
+        i += length
+    return bytes(out)
+
+
+def expand(tokens, history=b''):
+    """What WriteCompressedFlashPage() does: returns the page, or None where
+    the bootloader would send '?'."""
+    text = bytearray(history)
+    base = len(text)
+    i = 0
+    while i < len(tokens):
+        token = tokens[i]
+        i += 1
+        if token & 0x80:
+            if token & 0x40:
+                if i + 2 > len(tokens):
+                    return None
+                length = (token & 0x3F) + 3
+                distance = tokens[i] << 8 | tokens[i + 1]
+                i += 2
+            else:
+                if i == len(tokens):
+                    return None
+                length = (token & 0x3F) + 2
+                distance = tokens[i] + 1
+                i += 1
+            if not distance:
+                return None
+            for _ in range(length):
+                if distance > len(text):
+                    return None
+                text.append(text[-distance])
+        else:
+            length = token + 1
+            if i + length > len(tokens):
+                return None
+            text += tokens[i:i + length]
+            i += length
+        if len(text) - base > PAGE_SIZE:
+            return None
+    return bytes(text[base:]) if len(text) - base == PAGE_SIZE else None
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Compresses flash pages for Caterina and checks them.')
+    parser.add_argument('hex', nargs='+', help='images to compress (.hex)')
+    parser.add_argument('-o', '--output', help='file to write the pages to (one input only)')
+    args = parser.parse_args()
+    if args.output and len(args.hex) > 1:
+        parser.error('--output needs a single input')
+
+    total_plain = total_sent = 0
+    for path in args.hex:
+        records = []
+        # The pages written so far that run up to the next one
+        history = bytearray()
+        for addr, page in pages(read_hex(path)):
+            if records and records[-1][0] + PAGE_SIZE != addr:
+                history = bytearray()
+            tokens = compress(page, history)
+            if expand(tokens, history) != page:
+                print('%s: page 0x%04x does not expand back' % (path, addr))
+                return 1
+            history += page
+            if len(tokens) < PAGE_SIZE:
+                records.append((addr, 'Z', tokens))
+            else:
+                records.append((addr, 'F', page))
+
+        plain = len(records) * PAGE_SIZE
+        sent = sum(len(data) for _, _, data in records)
+        total_plain += plain
+        total_sent += sent
+        print('%s: %d pages, %d bytes compressed to %d (%.2fx)'
+              % (path, len(records), plain, sent, plain / sent))
+
+        if args.output:
+            with open(args.output, 'wb') as f:
+                for addr, kind, data in records:
+                    f.write(struct.pack('>H', addr) + kind.encode() + bytes((len(data),)) + data)
+
+    if len(args.hex) > 1:
+        print('total: %d bytes compressed to %d (%.2fx)'
+              % (total_plain, total_sent, total_plain / total_sent))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
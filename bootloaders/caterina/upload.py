@@ -0,0 +1,146 @@
+#!/usr/bin/env python3
+"""Uploads a sketch to a Caterina board over its CDC port, and times it.
+
+This sends what avrdude's avr109 programmer sends for an upload: a chip
+erase, the address once, then a 'B' block write of the reported block
+size for each page, and a 'g' read back of the same blocks.  It reports
+the time of the erase, the write and the verify, and the write rate, so
+two builds of Caterina (say the standard one and "make HIGH_THROUGHPUT=1")
+can be compared on the same board with the same image:
+
+    python3 upload.py /dev/ttyACM0 --random 28672
+    python3 upload.py /dev/ttyACM0 Blink.ino.hex --crc
+
+--random writes that many bytes of fixed pseudo-random data instead of a
+sketch, which does not compress and is the same on every run; the board
+then has no sketch to start, and stays in the bootloader until its
+timeout.  --crc verifies with the 'z' command of a FLASH_CRC_SUPPORT build
+instead of reading the flash back (../crc16.py).
+
+By default the board is reset into the bootloader the way the Arduino IDE
+does it, by opening the sketch's port at 1200 baud and closing it, and the
+bootloader's port is waited for; --no-reset skips this when the bootloader
+is already running.  Needs pyserial.
+"""
+
+import argparse
+import os
+import random
+import sys
+import time
+
+import serial
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+from crc16 import crc16_modbus, read_hex
+
+
+class UploadError(Exception):
+    pass
+
+
+class Port(object):
+    """An AVR109 connection to the bootloader."""
+
+    def __init__(self, device, timeout=2.0):
+        self.serial = serial.Serial(device, 57600, timeout=timeout)
+        self.serial.reset_input_buffer()
+
+    def command(self, data, reply):
+        self.serial.write(data)
+        value = self.serial.read(reply)
+        if len(value) != reply:
+            raise UploadError('no reply to %r' % data[:1])
+        return value
+
+    def expect_cr(self, data):
+        value = self.command(data, 1)
+        if value != b'\r':
+            raise UploadError('%r answered %r' % (data[:1], value))
+
+
+def touch_reset(device, wait=10.0):
+    """Resets the board into the bootloader with a 1200 baud open and close,
+    and returns once its port can be opened again."""
+    serial.Serial(device, 1200).close()
+    time.sleep(0.5)
+    deadline = time.monotonic() + wait
+    while time.monotonic() < deadline:
+        try:
+            serial.Serial(device).close()
+            return
+        except serial.SerialException:
+            time.sleep(0.1)
+    raise UploadError('%s did not come back after the reset' % device)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Timed AVR109 upload to a Caterina board.')
+    parser.add_argument('port', help='serial port, e.g. /dev/ttyACM0 or COM3')
+    parser.add_argument('image', nargs='?', help='sketch .hex to upload')
+    parser.add_argument('--random', type=int, metavar='BYTES',
+                        help='upload this many bytes of pseudo-random data instead')
+    parser.add_argument('--crc', action='store_true',
+                        help="verify with the 'z' command instead of reading back")
+    parser.add_argument('--no-verify', action='store_true', help='skip the verify')
+    parser.add_argument('--no-reset', action='store_true',
+                        help="don't reset the board with a 1200 baud touch first")
+    args = parser.parse_intermixed_args()
+
+    if args.random is not None:
+        image = bytearray(random.Random(0).getrandbits(8) for _ in range(args.random))
+    elif args.image:
+        image = read_hex(args.image)
+    else:
+        parser.error('an image is needed, or --random')
+
+    try:
+        if not args.no_reset:
+            touch_reset(args.port)
+        port = Port(args.port)
+        start = time.monotonic()
+        print('%s: %s' % (args.port, port.command(b'S', 7).decode('ascii', 'replace')))
+        reply = port.command(b'b', 3)
+        if reply[0:1] != b'Y':
+            raise UploadError('the bootloader does not do block writes')
+        block = reply[1] << 8 | reply[2]
+        image += b'\xff' * (-len(image) % block)
+
+        port.expect_cr(b'e')
+        erased = time.monotonic()
+        port.expect_cr(b'A\x00\x00')
+        for addr in range(0, len(image), block):
+            port.expect_cr(b'B' + bytes((block >> 8, block & 0xFF)) + b'F' + image[addr:addr + block])
+        written = time.monotonic()
+
+        if not args.no_verify:
+            port.expect_cr(b'A\x00\x00')
+            if args.crc:
+                # Blocks of at most 0xfffe bytes, each 'z' carrying on from the last
+                for addr in range(0, len(image), 0xfffe):
+                    chunk = image[addr:addr + 0xfffe]
+                    reply = port.command(b'z' + bytes((len(chunk) >> 8, len(chunk) & 0xFF)), 2)
+                    if reply[0] << 8 | reply[1] != crc16_modbus(chunk):
+                        raise UploadError('CRC mismatch in 0x%04x-0x%04x'
+                                          % (addr, addr + len(chunk) - 1))
+            else:
+                for addr in range(0, len(image), block):
+                    if port.command(b'g' + bytes((block >> 8, block & 0xFF)) + b'F',
+                                    block) != image[addr:addr + block]:
+                        raise UploadError('verify mismatch in the block at 0x%04x' % addr)
+        verified = time.monotonic()
+        port.expect_cr(b'E')
+    except (UploadError, serial.SerialException) as e:
+        print('%s: %s' % (args.port, e))
+        return 1
+
+    print('%d bytes in %d-byte blocks: erase %.3f s, write %.3f s (%.1f KB/s), '
+          'verify %.3f s, total %.3f s' % (
+              len(image), block, erased - start, written - erased,
+              len(image) / 1024.0 / (written - erased), verified - written, verified - start))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,142 @@
+#!/usr/bin/env python3
+"""Host reference for the CRC that the bootloaders' 'z' command returns.
+
+Optiboot and Caterina built with FLASH_CRC_SUPPORT return the
+CRC-16/MODBUS of a block of flash: polynomial 0x8005 reflected (0xA001),
+initial value 0xFFFF, no final XOR, sent high byte first.  Both run
+avr-libc's _crc16_update() over the block, starting at the loaded
+address.  A block length of 0 is an empty block, whose CRC is 0xFFFF.
+
+This script prints the CRC a device holding an image would return for a
+range of it, with 0xff where the image has no data, as avrdude leaves
+flash after a chip erase:
+
+    python3 crc16.py image.hex [--start ADDR] [--length N]
+
+With --test it checks the CRC against published check values, and
+against a table-driven version over every .hex image in the tree.
+
+delta.py uses crc16_modbus() to name the image a delta update applies to.
+"""
+
+import argparse
+import glob
+import os
+import sys
+
+POLY = 0xA001
+
+
+def crc16_update(crc, byte):
+    """One step of the CRC, as avr-libc's _crc16_update() does it."""
+    crc ^= byte
+    for _ in range(8):
+        crc = (crc >> 1) ^ POLY if crc & 1 else crc >> 1
+    return crc
+
+
+def crc16_modbus(data):
+    """CRC-16/MODBUS of data, which may be empty."""
+    crc = 0xFFFF
+    for b in data:
+        crc = crc16_update(crc, b)
+    return crc
+
+
+TABLE = [crc16_update(0, n) for n in range(256)]
+
+
+def crc16_modbus_table(data):
+    """The same CRC, a byte at a time from a table."""
+    crc = 0xFFFF
+    for b in data:
+        crc = (crc >> 8) ^ TABLE[(crc ^ b) & 0xFF]
+    return crc
+
+
+def read_hex(path):
+    """Returns a bytearray of the image from address 0 to its last byte,
+    with 0xff where it has no data."""
+    data = {}
+    base = 0
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if not line.startswith(':'):
+                continue
+            rec = bytes.fromhex(line[1:])
+            if sum(rec) & 0xFF:
+                raise ValueError('%s: bad checksum' % path)
+            count, addr, kind = rec[0], rec[1] << 8 | rec[2], rec[3]
+            if kind == 0:
+                for i in range(count):
+                    data[base + addr + i] = rec[4 + i]
+            elif kind == 2:
+                base = (rec[4] << 8 | rec[5]) << 4
+            elif kind == 4:
+                base = (rec[4] << 8 | rec[5]) << 16
+            elif kind == 1:
+                break
+    image = bytearray(b'\xff') * (max(data) + 1 if data else 0)
+    for addr, b in data.items():
+        image[addr] = b
+    return image
+
+
+def test():
+    """Returns the number of failed checks."""
+    failed = 0
+
+    def check(what, got, want):
+        nonlocal failed
+        ok = got == want
+        failed += not ok
+        print('%-48s 0x%04x %s' % (what, got, 'ok' if ok else 'FAILED, want 0x%04x' % want))
+
+    check('"123456789"', crc16_modbus(b'123456789'), 0x4B37)
+    check('MODBUS frame 01 03 00 00 00 0a', crc16_modbus(bytes.fromhex('01030000000a')), 0xCDC5)
+    check('empty block', crc16_modbus(b''), 0xFFFF)
+
+    here = os.path.dirname(os.path.abspath(__file__))
+    for path in sorted(glob.glob(os.path.join(here, '*', '*.hex'))):
+        image = read_hex(path)
+        name = os.path.relpath(path, here)
+        for start in sorted({0, min(i for i, b in enumerate(image) if b != 0xFF)}):
+            block = bytes(image[start:])
+            crc = crc16_modbus(block)
+            check('%s 0x%04x-0x%04x' % (name, start, len(image) - 1),
+                  crc, crc16_modbus_table(block))
+            # A block followed by its CRC, low byte first, leaves 0
+            check('  with its CRC appended', crc16_modbus(block + bytes((crc & 0xFF, crc >> 8))), 0)
+    return failed
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Prints the CRC-16/MODBUS the \'z\' command returns for a range of an image.')
+    parser.add_argument('hex', nargs='?', help='image (.hex)')
+    parser.add_argument('--start', type=lambda s: int(s, 0), default=0,
+                        help='byte address to start at (default 0)')
+    parser.add_argument('--length', type=lambda s: int(s, 0),
+                        help='number of bytes (default: to the end of the image)')
+    parser.add_argument('--test', action='store_true',
+                        help='check the CRC against known values and the images in the tree')
+    args = parser.parse_args()
+
+    if args.test:
+        return 1 if test() else 0
+    if not args.hex:
+        parser.error('an image is needed, or --test')
+
+    image = read_hex(args.hex)
+    length = len(image) - args.start if args.length is None else args.length
+    if length < 0 or length > 0xFFFF:
+        parser.error('the length has to be 0-65535')
+    block = bytes(image[args.start:args.start + length])
+    block += b'\xff' * (length - len(block))
+    print('0x%04x-0x%04x: 0x%04x' % (args.start, args.start + length - 1, crc16_modbus(block)))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
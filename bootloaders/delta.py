@@ -0,0 +1,247 @@
+#!/usr/bin/env python3
+"""Makes a delta update from the image on a device to a new one.
+
+Optiboot built with DELTA_PAGES and Caterina built with DELTA_BLOCK_SUPPORT
+accept a flash page as a patch against the flash that is already there
+(memory type 'D' instead of 'F').  A patch is a sequence of operations:
+
+    0x00-0x7f  insert (op + 1) bytes, which follow the op
+    0x80-0xff  copy ((op & 0x7f) + 1) bytes of flash from the byte address
+               in the next two bytes, high byte first
+
+and must make exactly one page.  This script diffs NEW.hex against OLD.hex,
+the image the device holds, and writes the pages that change as patches,
+or as plain pages where a patch would not be smaller.
+
+The bootloaders apply the pages in the order they are sent, lowest address
+first, and a copy reads the flash as it is at that moment.  A page that
+was rewritten earlier in the same update already holds its new contents,
+so copies are matched against the device flash as it will be at that
+point, not against OLD.hex.  The page being written still holds its old
+contents, because a patch is applied before its page is erased.  Every
+patch is checked by applying the whole update to a copy of OLD.hex and
+comparing the result with NEW.hex.
+
+The host should only send the update to a device whose image is OLD.hex,
+which the CRC-16/MODBUS the 'z' command returns (both bootloaders, with
+FLASH_CRC_SUPPORT) shows.  The CRC that matches is printed, and stored in
+the output file, which holds:
+
+    uint16  length of flash covered by the CRC, from address 0
+    uint16  CRC-16/MODBUS of that flash
+    then for each page, in order:
+    uint8   'D' for a patch or 'F' for a whole page
+    uint16  byte address of the page
+    uint16  number of bytes that follow
+    ...     the patch or page
+
+with all numbers high byte first.  A patch is only used if it is shorter
+than the page, which also keeps it within Optiboot's 256-byte buffer.
+
+    python3 delta.py old.hex new.hex -o update.bin
+"""
+
+import argparse
+import struct
+import sys
+
+from crc16 import crc16_modbus
+
+FLASH_SIZE = 0x8000
+PAGE_SIZE = 128
+MIN_COPY = 4     # a copy op takes 3 bytes
+KEY = 4
+MAX_CANDIDATES = 32
+
+
+def read_hex(path):
+    """Returns a FLASH_SIZE bytearray of the image (0xff where it has no
+    data) and the address after its last byte."""
+    image = bytearray(b'\xff') * FLASH_SIZE
+    high = 0
+    base = 0
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if not line.startswith(':'):
+                continue
+            rec = bytes.fromhex(line[1:])
+            if sum(rec) & 0xFF:
+                raise ValueError('%s: bad checksum' % path)
+            count, addr, kind = rec[0], rec[1] << 8 | rec[2], rec[3]
+            if kind == 0:
+                addr += base
+                if addr + count > FLASH_SIZE:
+                    raise ValueError('%s: data past the end of flash' % path)
+                image[addr:addr + count] = rec[4:4 + count]
+                high = max(high, addr + count)
+            elif kind == 2:
+                base = (rec[4] << 8 | rec[5]) << 4
+            elif kind == 1:
+                break
+    return image, high
+
+
+class FlashIndex(object):
+    """Positions of every KEY-byte string in a copy of flash that is kept
+    up to date as pages are rewritten."""
+
+    def __init__(self, flash, size):
+        self.flash = flash
+        self.size = size
+        self.positions = {}
+        self._add(0, size)
+
+    def _keys(self, start, end):
+        start = max(start, 0)
+        end = min(end, self.size - KEY + 1)
+        for i in range(start, end):
+            yield bytes(self.flash[i:i + KEY]), i
+
+    def _add(self, start, end):
+        for key, i in self._keys(start, end):
+            self.positions.setdefault(key, []).append(i)
+
+    def _remove(self, start, end):
+        for key, i in self._keys(start, end):
+            self.positions[key].remove(i)
+
+    def write_page(self, addr, data):
+        self._remove(addr - KEY + 1, addr + PAGE_SIZE)
+        self.flash[addr:addr + PAGE_SIZE] = data
+        self._add(addr - KEY + 1, addr + PAGE_SIZE)
+
+    def longest_match(self, data, pos):
+        """Returns (address, length) of the longest run of flash matching
+        data from pos, up to 128 bytes."""
+        best = (0, 0)
+        limit = min(128, len(data) - pos)
+        if limit < KEY:
+            return best
+        flash = self.flash
+        for addr in self.positions.get(bytes(data[pos:pos + KEY]), ())[:MAX_CANDIDATES]:
+            n = KEY
+            top = min(limit, self.size - addr)
+            while n < top and flash[addr + n] == data[pos + n]:
+                n += 1
+            if n > best[1]:
+                best = (addr, n)
+                if n == limit:
+                    break
+        return best
+
+
+def make_patch(index, page):
+    """Encodes page as inserts and copies from the flash in index."""
+    patch = bytearray()
+    literal = bytearray()
+
+    def flush():
+        while literal:
+            chunk = literal[:128]
+            del literal[:128]
+            patch.append(len(chunk) - 1)
+            patch.extend(chunk)
+
+    pos = 0
+    while pos < len(page):
+        addr, n = index.longest_match(page, pos)
+        if n >= MIN_COPY:
+            flush()
+            patch.append(0x80 | (n - 1))
+            patch.extend(struct.pack('>H', addr))
+            pos += n
+        else:
+            literal.append(page[pos])
+            pos += 1
+    flush()
+    return bytes(patch)
+
+
+def apply_patch(flash, patch):
+    """What the bootloaders do with a patch: returns the page it makes."""
+    page = bytearray()
+    i = 0
+    while i < len(patch):
+        op = patch[i]
+        n = (op & 0x7F) + 1
+        if op & 0x80:
+            src = patch[i + 1] << 8 | patch[i + 2]
+            page.extend(flash[src:src + n])
+            i += 3
+        else:
+            page.extend(patch[i + 1:i + 1 + n])
+            i += 1 + n
+    if len(page) != PAGE_SIZE:
+        raise ValueError('patch makes %d bytes' % len(page))
+    return page
+
+
+def make_update(old, new, size):
+    """Returns the list of (kind, address, data) records that turn old
+    into new, in the order they have to be sent."""
+    index = FlashIndex(bytearray(old), size)
+    records = []
+    for addr in range(0, size, PAGE_SIZE):
+        page = new[addr:addr + PAGE_SIZE]
+        if index.flash[addr:addr + PAGE_SIZE] == page:
+            continue
+        patch = make_patch(index, page)
+        if len(patch) < PAGE_SIZE:
+            records.append(('D', addr, patch))
+        else:
+            records.append(('F', addr, bytes(page)))
+        index.write_page(addr, page)
+    return records
+
+
+def check_update(old, new, size, records):
+    flash = bytearray(old)
+    for kind, addr, data in records:
+        page = apply_patch(flash, data) if kind == 'D' else data
+        flash[addr:addr + PAGE_SIZE] = page
+    if flash[:size] != new[:size]:
+        raise ValueError('the update does not reproduce the new image')
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Makes a delta update between two flash images.')
+    parser.add_argument('old', help='image on the device (.hex)')
+    parser.add_argument('new', help='image to update to (.hex)')
+    parser.add_argument('-o', '--output', help='file to write the update to')
+    parser.add_argument('--size', type=lambda s: int(s, 0),
+                        help='bytes of flash to cover (default: both images, rounded up to a page)')
+    args = parser.parse_args()
+
+    old, old_high = read_hex(args.old)
+    new, new_high = read_hex(args.new)
+    size = args.size or -(-max(old_high, new_high) // PAGE_SIZE) * PAGE_SIZE
+    if size % PAGE_SIZE or size > FLASH_SIZE:
+        parser.error('--size must be a multiple of %d up to %d' % (PAGE_SIZE, FLASH_SIZE))
+
+    records = make_update(old, new, size)
+    check_update(old, new, size, records)
+
+    crc = crc16_modbus(old[:size])
+    sent = sum(len(data) for _, _, data in records)
+    full = sum(PAGE_SIZE for addr in range(0, size, PAGE_SIZE)
+               if new[addr:addr + PAGE_SIZE] != b'\xff' * PAGE_SIZE)
+    patches = sum(1 for kind, _, _ in records if kind == 'D')
+
+    print('device CRC-16/MODBUS of 0x0000-0x%04x: 0x%04x' % (size - 1, crc))
+    print('%d pages change: %d as patches, %d whole' % (len(records), patches, len(records) - patches))
+    if sent:
+        print('%d bytes of page data instead of %d for a full upload (%.1fx less)'
+              % (sent, full, full / sent))
+
+    if args.output:
+        with open(args.output, 'wb') as f:
+            f.write(struct.pack('>HH', size, crc))
+            for kind, addr, data in records:
+                f.write(kind.encode() + struct.pack('>HH', addr, len(data)) + data)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+"""Writes the boot record page that picks the slot an AB_SLOTS build runs.
+
+An Optiboot build with AB_SLOTS (the atmega328pb_*_ab targets) runs the
+application from one of two slots, A at 0x0100 and B at 0x3e00, 0x3d00
+bytes each, as named by the boot record page at 0x7b80:
+
+    0x7b80  0xab5e (magic)
+    0x7b82  active slot (0 = A, 1 = B)
+    0x7b84  slot A image length, then its CRC-16/MODBUS
+    0x7b88  slot B image length, then its CRC-16/MODBUS
+
+all little-endian words.  A sketch for a slot has to be linked to run
+there, which the Arduino tools do with a build property:
+
+    arduino-cli compile -b <board> --output-dir out \\
+        --build-property compiler.c.elf.extra_flags=-Wl,--section-start=.text=0x0100
+
+(0x3e00 for slot B).  This script checks that each image given starts at
+its slot with a jump into the slot and fits, works out its length and CRC
+the way the bootloader does, and writes the record page as a .hex:
+
+    python3 abrecord.py --a out/A.ino.hex --b old/B.ino.hex --active a -o record.hex
+
+Upload the slot image first and the record last: writing the record page
+is the switch, and until then the bootloader keeps running the old slot.
+Both are ordinary uploads, so avrdude writes them with -D, for example
+"avrdude -c arduino -p m328pb -P PORT -b BAUD -D -U flash:w:record.hex:i".
+A slot that is not given gets length 0, which the bootloader never picks.
+"""
+
+import argparse
+import os
+import struct
+import sys
+
+from simulate import PAGE_SIZE, SimError, read_hex
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+from crc16 import crc16_modbus
+
+SLOTS = {'a': 0x0100, 'b': 0x3e00}
+SLOT_SIZE = 0x3d00
+RECORD = 0x7b80
+MAGIC = 0xab5e
+
+
+def slot_entry(path, base):
+    """Returns (length, CRC) of a slot image, after checking that it was
+    linked for the slot and that every page up to its end is written."""
+    flash, low, high = read_hex(path)
+    if low != base:
+        raise SimError('%s starts at 0x%04x, not at the slot (0x%04x); was it linked there?'
+                       % (path, low, base))
+    if high - base > SLOT_SIZE:
+        raise SimError('%s is %d bytes, more than the slot\'s %d' % (path, high - base, SLOT_SIZE))
+    w0, w1 = struct.unpack_from('<HH', flash, base)
+    if w0 & 0xFE0E != 0x940C:
+        raise SimError('%s does not start with a jmp (its reset vector)' % path)
+    target = (((w0 & 0x01F0) << 13) | ((w0 & 1) << 16) | w1) * 2
+    if not base <= target < base + SLOT_SIZE:
+        raise SimError('%s jumps to 0x%04x, outside the slot; was it linked there?'
+                       % (path, target))
+
+    # The CRC covers flash as the upload leaves it, so a page the image
+    # has no data in would hold whatever was there before.  The bytes the
+    # image has are the ones that read the same with another fill.
+    zeros, _, _ = read_hex(path, fill=0x00)
+    for page in range(base, high, PAGE_SIZE):
+        if not any(flash[a] == zeros[a] for a in range(page, page + PAGE_SIZE)):
+            raise SimError('%s has no data in the page at 0x%04x, which the CRC covers'
+                           % (path, page))
+    return high - base, crc16_modbus(bytes(flash[base:high]))
+
+
+def hex_records(addr, data):
+    """Intel hex lines for data at addr, 16 bytes a line."""
+    lines = []
+    for i in range(0, len(data), 16):
+        chunk = data[i:i + 16]
+        rec = bytes((len(chunk), (addr + i) >> 8, (addr + i) & 0xFF, 0)) + chunk
+        lines.append(':%s%02X' % (rec.hex().upper(), -sum(rec) & 0xFF))
+    lines.append(':00000001FF')
+    return '\n'.join(lines) + '\n'
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Writes the AB_SLOTS boot record page as a .hex.')
+    parser.add_argument('--a', metavar='HEX', help='image in slot A, linked at 0x0100')
+    parser.add_argument('--b', metavar='HEX', help='image in slot B, linked at 0x3e00')
+    parser.add_argument('--active', choices=('a', 'b'), required=True, help='slot to run')
+    parser.add_argument('-o', '--output', required=True, help='record page .hex to write')
+    args = parser.parse_args()
+
+    entries = {}
+    try:
+        for slot, base in sorted(SLOTS.items()):
+            path = getattr(args, slot)
+            entries[slot] = slot_entry(path, base) if path else (0, 0xFFFF)
+    except (SimError, OSError) as e:
+        print(e)
+        return 1
+    if not entries[args.active][0]:
+        parser.error('the active slot needs an image')
+
+    record = struct.pack('<HHHHHH', MAGIC, args.active == 'b',
+                         entries['a'][0], entries['a'][1],
+                         entries['b'][0], entries['b'][1])
+    record += b'\xff' * (PAGE_SIZE - len(record))
+    with open(args.output, 'w') as f:
+        f.write(hex_records(RECORD, record))
+
+    for slot, base in sorted(SLOTS.items()):
+        length, crc = entries[slot]
+        print('slot %s at 0x%04x: %s%s' % (
+            slot.upper(), base,
+            '%d bytes, CRC 0x%04x' % (length, crc) if length else 'empty',
+            ' (active)' if slot == args.active else ''))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+"""Checks the AUTOBAUD rate table in optiboot.c against the arithmetic.
+
+AUTOBAUD times the first low period of STK_GET_SYNC (the start bit and
+four 0 bits) with Timer1 at F_CPU, polling PIND, and sets
+
+    UBRR = (bitTime5 + 20) / 40 - 1
+
+so that the U2X rate F_CPU / (8 * (UBRR + 1)) is the nearest the clock
+gives.  Each edge is seen by a three-cycle polling loop, so bitTime5 is
+5 * F_CPU / baud give or take POLL_CYCLES.  For each clock and rate this
+script works out the UBRR the bootloader picks over that whole range, and
+the error of the rate it then runs at.  A rate is usable if it always
+gets the same UBRR and the error is within MAX_ERROR, and exact if the
+error is 0.
+
+It then reads the table from the AUTOBAUD comment in optiboot.c and
+checks that every rate it calls exact is, that every error it gives
+matches to 0.1%, and that a rate it calls not reachable is not usable.
+It exits with 1 if any of this fails:
+
+    python3 baudcheck.py [--rates 57600,115200,...]
+
+simulate.py checks the same thing end to end on a built image, with the
+host at any rate: "make simulate_autobaud".
+"""
+
+import argparse
+import os
+import re
+import sys
+
+CLOCKS = (8000000, 12000000, 16000000, 20000000)
+RATES = (57600, 115200, 230400, 250000, 460800, 500000, 921600, 1000000, 1250000)
+POLL_CYCLES = 3
+# What the 16MHz Arduino boards run 115200 at, and what the U2X receiver
+# is specified to cope with for 8 data bits
+MAX_ERROR = 0.025
+
+
+def autobaud_ubrr(bit_time5):
+    """What the bootloader writes to UBRR0L for a measured bitTime5."""
+    ch = ((bit_time5 + 20) // 40) & 0xFF
+    return (ch - 1) & 0xFF
+
+
+def in_range(f_cpu, baud):
+    """Whether the 20 bit times of idleTime fit Timer1, and UBRR fits UBRR0L."""
+    bit_time5 = 5 * f_cpu / baud
+    return bit_time5 * 4 < 0x10000 and (bit_time5 + 20) // 40 <= 0x100
+
+
+def check(f_cpu, baud):
+    """Returns (UBRR, error) for the rate, with UBRR None if the bootloader
+    can pick more than one, or the rate is out of range."""
+    bit_time5 = 5 * f_cpu / baud
+    if not in_range(f_cpu, baud):
+        return None, None
+    choices = {autobaud_ubrr(int(bit_time5 + e)) for e in range(-POLL_CYCLES, POLL_CYCLES + 1)}
+    if len(choices) > 1:
+        return None, None
+    ubrr = choices.pop()
+    return ubrr, f_cpu / (8.0 * (ubrr + 1)) / baud - 1
+
+
+def parse_rate(text):
+    text = text.strip()
+    scale = {'k': 1000, 'M': 1000000}.get(text[-1], 1)
+    return int(float(text.rstrip('kM')) * scale)
+
+
+def read_table(path):
+    """Returns {f_cpu: (exact rates, {rate: error}, unreachable rates)} from
+    the AUTOBAUD comment."""
+    lines = []
+    with open(path) as f:
+        inside = False
+        for line in f:
+            body = line.strip()[2:-2].strip()
+            if body.startswith('AUTOBAUD:'):
+                inside = True
+            elif inside and not body:
+                break
+            elif inside:
+                lines.append(body)
+
+    table = {}
+    for body in lines:
+        m = re.match(r'\((\S+) is not reachable at (\d+)MHz\)', body)
+        if m:
+            table[int(m.group(2)) * 1000000][2].add(parse_rate(m.group(1)))
+            continue
+        m = re.match(r'(\d+)MHz:\s*(.*)', body)
+        if not m:
+            continue
+        f_cpu = int(m.group(1)) * 1000000
+        table[f_cpu] = (set(), {}, set())
+        body = m.group(2)
+        for part in body.split(';'):
+            part = part.strip()
+            if part.endswith('exact'):
+                table[f_cpu][0].update(parse_rate(r) for r in part[:-5].split(','))
+            elif part:
+                rate, error = part.split()
+                table[f_cpu][1][parse_rate(rate)] = float(error.rstrip('%')) / 100
+    return table
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Checks the AUTOBAUD rate table in optiboot.c.')
+    parser.add_argument('--rates', type=lambda s: [int(r) for r in s.split(',')],
+                        default=RATES, help='rates to list, comma separated')
+    parser.add_argument('--source', default=os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                                                         'optiboot.c'))
+    args = parser.parse_args()
+
+    rates = sorted(set(args.rates))
+    print('%-8s' % 'rate' + ''.join('%18s' % ('%dMHz' % (f // 1000000)) for f in CLOCKS))
+    for baud in rates:
+        row = '%-8d' % baud
+        for f_cpu in CLOCKS:
+            ubrr, error = check(f_cpu, baud)
+            if ubrr is None:
+                row += '%18s' % ('unstable' if in_range(f_cpu, baud) else 'out of range')
+            else:
+                row += '%18s' % ('UBRR %3d %+6.2f%%%s' % (
+                    ubrr, 100 * error, ' ' if abs(error) <= MAX_ERROR else '!'))
+        print(row)
+
+    failed = 0
+    for f_cpu, (exact, errors, unreachable) in sorted(read_table(args.source).items()):
+        for baud in sorted(exact):
+            ubrr, error = check(f_cpu, baud)
+            if ubrr is None or error:
+                print('%dMHz: the table says %d is exact, it is %s' % (
+                    f_cpu // 1000000, baud, 'unstable' if ubrr is None else '%+.2f%%' % (100 * error)))
+                failed += 1
+        for baud, claimed in sorted(errors.items()):
+            ubrr, error = check(f_cpu, baud)
+            if ubrr is None or round(error, 3) != round(claimed, 3):
+                print('%dMHz: the table says %d is %+.1f%%, it is %s' % (
+                    f_cpu // 1000000, baud, 100 * claimed,
+                    'unstable' if ubrr is None else '%+.2f%%' % (100 * error)))
+                failed += 1
+        for baud in sorted(unreachable):
+            ubrr, error = check(f_cpu, baud)
+            if ubrr is not None and abs(error) <= MAX_ERROR:
+                print('%dMHz: the table says %d is not reachable, it is %+.2f%%' % (
+                    f_cpu // 1000000, baud, 100 * error))
+                failed += 1
+    print('table in %s: %s' % (os.path.basename(args.source),
+                                'ok' if not failed else '%d problems' % failed))
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -23,8 +23,9 @@
 /*                                                        */
 /* What you lose:                                         */
 /*   Implements a skeleton STK500 protocol which is       */
-/*     missing several features including EEPROM          */
-/*     programming and non-page-aligned writes            */
+/*     missing several features including non-page-       */
+/*     aligned writes, and EEPROM programming unless      */
+/*     SUPPORT_EEPROM is defined                          */
 /*   High baud rate breaks compatibility with standard    */
 /*     Arduino flash settings                             */
 /*                                                        */
@@ -98,6 +99,18 @@
 /* LUDICROUS_SPEED:                                       */
 /* 230400 baud :-)                                        */
 /*                                                        */
+/* AUTOBAUD:                                              */
+/* Time the host's first STK_GET_SYNC with timer 1 and    */
+/* set the U2X divisor to match, so the host can use any  */
+/* rate the crystal divides cleanly. With U2X, the rate   */
+/* is F_CPU / (8 * (UBRR + 1)):                           */
+/*   16MHz: 1M, 500k, 250k exact; 115200 +2.1%            */
+/*   20MHz: 1.25M, 500k, 250k exact; 115200 -1.4%         */
+/*          (1M is not reachable at 20MHz)                */
+/*   12MHz: 500k, 250k exact; 115200 +0.2%                */
+/*    8MHz: 1M, 500k, 250k exact; 57600 +2.1%             */
+/* baudcheck.py checks this table.                        */
+/*                                                        */
 /* SOFT_UART:                                             */
 /* Use AVR305 soft-UART instead of hardware UART.         */
 /*                                                        */
@@ -110,12 +123,107 @@
 /*                                                        */
 /* SUPPORT_EEPROM:                                        */
 /* Support reading and writing from EEPROM. This is not   */
-/* used by Arduino, so off by default.                    */
+/* used by Arduino, so off by default. EEPROM writes are  */
+/* queued and done in the background while the host sends */
+/* the next block.                                        */
 /*                                                        */
 /* TIMEOUT_MS:                                            */
 /* Bootloader timeout period, in milliseconds.            */
 /* 500,1000,2000,4000,8000 supported.                     */
 /*                                                        */
+/* PIPELINE_PAGES:                                        */
+/* Send STK_OK as soon as an RWW page write has started,  */
+/* so the host can send the next page while the write     */
+/* finishes. The next page erase is started from the      */
+/* receive loop once the SPM unit is free. NRWW pages     */
+/* halt the CPU and are still written synchronously.      */
+/* With SKIP_UNCHANGED_PAGES the page has to be compared  */
+/* before it is erased, so only the write is overlapped.  */
+/*                                                        */
+/* SKIP_UNCHANGED_PAGES:                                  */
+/* Compare each received page with the flash it would     */
+/* replace and skip the erase and write if they match.    */
+/* The reply is unchanged, so stock avrdude still works.  */
+/*                                                        */
+/* FLASH_CRC_SUPPORT:                                     */
+/* Add a 'z' command that returns the CRC-16/MODBUS of a  */
+/* block of flash, so a host can verify an upload without */
+/* reading every byte back. A length of 0 is an empty     */
+/* block (CRC 0xFFFF).                                    */
+/*                                                        */
+/* STREAM_PAGES:                                          */
+/* Add a 'y' command that writes a run of pages from the  */
+/* loaded address on, without a LOAD ADDRESS and reply    */
+/* per page. The host sends 'y', a page count (1-255) and */
+/* CRC_EOP, and gets STK_INSYNC (or STK_FAILED alone if   */
+/* the run would reach the NRWW section). It may then     */
+/* send two pages straight away, and one more for each    */
+/* STK_INSYNC that comes back as a page buffer is freed.  */
+/* STK_OK follows the last page write.                    */
+/*                                                        */
+/* BULK_READ:                                             */
+/* Use all 16 bits of the STK_READ_PAGE length for flash, */
+/* so a whole image can be read back with one command.    */
+/* Memory type 'R' reads flash with runs of 0xFF sent as  */
+/* 0xFF and (run length - 1), so erased flash costs two   */
+/* bytes per 256. EEPROM reads still use the low byte.    */
+/*                                                        */
+/* AB_SLOTS:                                              */
+/* Split a 32k application section (1k bootloader) into   */
+/* two slots, A at 0x0100 and B at 0x3e00, 0x3d00 bytes   */
+/* each. Slot images are linked to run at their slot and  */
+/* are written with the normal page commands. The boot    */
+/* record page at 0x7b80 holds, as little-endian words:   */
+/*   0x7b80: 0xab5e (magic)                               */
+/*   0x7b82: active slot (0 = A, 1 = B)                   */
+/*   0x7b84: slot A image length, then its CRC-16/MODBUS  */
+/*   0x7b88: slot B image length, then its CRC-16/MODBUS  */
+/* Before starting the application, the bootloader checks */
+/* the CRC of the active slot, falling back to the other  */
+/* slot if it fails, copies that slot's vector table to   */
+/* address 0 if needed, and jumps to the slot. Writing    */
+/* the record page is the atomic switch. Writing page 0   */
+/* erases the record, so plain uploads keep working.      */
+/*                                                        */
+/* SPM_API:                                               */
+/* Let applications erase, fill and write flash pages by  */
+/* calling do_spm() through a jump at 0x7ffc, just below  */
+/* the version word, which stays put between builds. See  */
+/* OptibootSelfUpdate.h in the A-Star 328PB variant.      */
+/*                                                        */
+/* DELTA_PAGES:                                           */
+/* Accept STK_PROG_PAGE with memory type 'D', where the   */
+/* data is a patch against the current flash: 0x00-0x7f   */
+/* inserts (op + 1) bytes that follow, 0x80-0xff copies   */
+/* ((op & 0x7f) + 1) bytes of flash from the big endian   */
+/* byte address that follows. Hosts can identify the      */
+/* image to diff against with the 'z' CRC command. Needs  */
+/* SKIP_UNCHANGED_PAGES, which keeps the old page around  */
+/* until the new one has been built.                      */
+/* Copies read flash as it is when the page arrives, so a */
+/* page already rewritten by the same update holds its    */
+/* new contents. bootloaders/delta.py makes patches that  */
+/* allow for this.                                        */
+/*                                                        */
+/* BOOT_TIMING:                                           */
+/* Run Timer3 at F_CPU/8 from reset, counting overflows   */
+/* in software, and leave a record at RAMSTART+0x500 for  */
+/* the application: words 0x5442 and MCUSR, then 32-bit   */
+/* times of UART ready, first command and application     */
+/* start. Times start at 1, so 0 means not reached.       */
+/* A reset that goes straight to the application keeps    */
+/* the UART and command times of the boot before it, so   */
+/* an upload's times survive the watchdog reset that ends */
+/* it. ATmega328PB only (Timer3).                         */
+/*                                                        */
+/* UPLOAD_STATS:                                          */
+/* Count bytes received, pages written, Timer1 ticks      */
+/* spent waiting for SPM (F_CPU/64), polls of the UART    */
+/* with no byte waiting and framing errors, and return    */
+/* them with the 'X' command as 16 bytes, little endian:  */
+/* 4 bytes, 2 pages, 4 SPM ticks, 4 polls, 2 errors.      */
+/* Hardware UART only.                                    */
+/*                                                        */
 /**********************************************************/
 
 /**********************************************************/
@@ -155,6 +263,16 @@
 asm("  .section .version\n"
     "optiboot_version:  .word " MAKEVER(OPTIBOOT_MAJVER, OPTIBOOT_MINVER) "\n"
     "  .section .text\n");
+
+#ifdef SPM_API
+// Allocated, unlike .version, so that the rjmp's relocation is applied.  The
+// Makefile names optiboot_spm_api with --undefined so --gc-sections keeps it.
+asm("  .section .spmapi,\"ax\",@progbits\n"
+    "  .global optiboot_spm_api\n"
+    "optiboot_spm_api:\n"
+    "  rjmp do_spm\n"
+    "  .section .text\n");
+#endif
 
 #include <inttypes.h>
 #include <avr/io.h>
@@ -170,6 +288,106 @@ asm("  .section .version\n"
 #include "pin_defs.h"
 #include "stk500.h"
 
+#ifdef FLASH_CRC_SUPPORT
+#include <util/crc16.h>
+
+/* Optiboot extension: CRC of a flash block, not part of STK500 */
+#define STK_CRC_FLASH       0x7A  // 'z'
+
+#ifdef VIRTUAL_BOOT_PARTITION
+#error FLASH_CRC_SUPPORT does not undo the vector patch of VIRTUAL_BOOT_PARTITION
+#endif
+#endif
+
+#ifdef STREAM_PAGES
+/* Optiboot extension: multi-page write, not part of STK500 */
+#define STK_PROG_STREAM     0x79  // 'y'
+
+#if defined(VIRTUAL_BOOT_PARTITION) || defined(SOFT_UART) || SPM_PAGESIZE > 128
+#error STREAM_PAGES is not supported on this target
+#endif
+#endif
+
+#ifdef AB_SLOTS
+#if defined(VIRTUAL_BOOT_PARTITION) || !defined(BIGBOOT) || \
+    !(defined(__AVR_ATmega328P__) || defined(__AVR_ATmega328__))
+#error AB_SLOTS needs a 1k bootloader on a 32k part
+#endif
+#include <util/crc16.h>
+
+#define AB_VECTORS   (2 * SPM_PAGESIZE)  // copy of the active vector table
+#define AB_SLOT_A    (0x0100)
+#define AB_SLOT_SIZE (0x3d00)
+#define AB_SLOT_B    (AB_SLOT_A + AB_SLOT_SIZE)
+#define AB_RECORD    (0x7b80)
+#define AB_MAGIC     (0xab5e)
+#endif
+
+#ifdef DELTA_PAGES
+#if !defined(SKIP_UNCHANGED_PAGES) || defined(VIRTUAL_BOOT_PARTITION)
+#error DELTA_PAGES needs SKIP_UNCHANGED_PAGES
+#endif
+#endif
+
+#ifdef BOOT_TIMING
+#ifndef REALLY_328PB
+#error BOOT_TIMING needs Timer3 of the ATmega328PB
+#endif
+#ifdef SOFT_UART
+#error BOOT_TIMING is not supported with SOFT_UART
+#endif
+// MCU_TARGET is atmega328p for the 328PB, so io.h has no Timer3
+#ifndef TCCR3B
+#define TCCR3B _SFR_MEM8(0x91)
+#define TCNT3  _SFR_MEM16(0x94)
+#endif
+#ifndef TIFR3
+#define TIFR3  _SFR_IO8(0x18)
+#endif
+#ifndef TOV3
+#define TOV3   0
+#endif
+#ifndef CS31
+#define CS31   1
+#endif
+#define BOOT_TIMING_MAGIC (0x5442)
+
+/*
+ * Times are F_CPU/8 ticks.  Timer3 overflows every 65536 ticks, which is
+ * 26ms at 20MHz, and the bootloader doesn't use interrupts, so the places
+ * that can wait that long call bootTimingPoll() to count the overflows.
+ */
+struct bootTiming {
+  uint16_t magic;
+  uint16_t mcusr;
+  uint32_t uart;
+  uint32_t command;
+  uint32_t appStart;
+  uint16_t overflows;
+};
+#endif
+
+#ifdef UPLOAD_STATS
+/* Optiboot extension: upload counters, not part of STK500 */
+#define STK_UPLOAD_STATS    0x58  // 'X'
+
+#ifdef SOFT_UART
+#error UPLOAD_STATS is not supported with SOFT_UART
+#endif
+
+struct uploadStats {
+  uint32_t bytes;
+  uint16_t pages;
+  uint32_t spmTicks;
+  uint32_t rxPolls;
+  uint16_t framingErrors;
+};
+#endif
+
+#if defined(BULK_READ) && (defined(VIRTUAL_BOOT_PARTITION) || defined(__AVR_ATmega1280__))
+#error BULK_READ is not supported on this target
+#endif
+
 #ifndef LED_START_FLASHES
 #define LED_START_FLASHES 0
 #endif
@@ -191,6 +409,15 @@ asm("  .section .version\n"
 #endif
 #endif
 
+#if defined(AUTOBAUD) && (defined(SOFT_UART) || defined(__AVR_ATmega8__))
+#error AUTOBAUD needs the USART0 hardware UART
+#endif
+
+#ifdef AUTOBAUD
+/* Line idle time, in CPU cycles, to wait for before timing the sync byte */
+#define AUTOBAUD_IDLE (F_CPU / 2000)
+#endif
+
 /* Switch in soft UART for hard baud rates */
 #if (F_CPU/BAUD_RATE) > 280 // > 57600 for 16MHz
 #ifndef SOFT_UART
@@ -229,7 +456,31 @@ void watchdogConfig(uint8_t x);
 #ifdef SOFT_UART
 void uartDelay() __attribute__ ((naked));
 #endif
+#ifdef SPM_API
+void do_spm(uint16_t address, uint8_t command, uint16_t data);
+#endif
+#ifdef AB_SLOTS
+void appStart(uint16_t) __attribute__ ((naked));
+void abStart();
+void abDropRecord();
+#else
 void appStart() __attribute__ ((naked));
+#endif
+
+#ifdef UPLOAD_STATS
+void statsSpmWait();
+#endif
+
+#ifdef BOOT_TIMING
+void bootTimingPoll();
+uint32_t bootTimingNow();
+#endif
+
+#ifdef SUPPORT_EEPROM
+void eepromService();
+void eepromQueue(uint16_t, uint8_t);
+void eepromFlush();
+#endif
 
 #if defined(__AVR_ATmega168__)
 #define RAMSTART (0x100)
@@ -255,10 +506,33 @@ void appStart() __attribute__ ((naked));
 /* These definitions are NOT zero initialised, but that doesn't matter */
 /* This allows us to drop the zero init code, saving us memory */
 #define buff    ((uint8_t*)(RAMSTART))
+#ifdef DELTA_PAGES
+#define deltaBuff ((uint8_t*)(RAMSTART+0x400))
+#endif
+#ifdef STREAM_PAGES
+#define streamBuff ((uint8_t*)(RAMSTART+SPM_PAGESIZE))
+#endif
+#ifdef BOOT_TIMING
+#define bootTiming (*(struct bootTiming*)(RAMSTART+0x500))
+#endif
+#ifdef UPLOAD_STATS
+#define stats (*(struct uploadStats*)(RAMSTART+0x520))
+#endif
 #ifdef VIRTUAL_BOOT_PARTITION
 #define rstVect (*(uint16_t*)(RAMSTART+SPM_PAGESIZE*2+4))
 #define wdtVect (*(uint16_t*)(RAMSTART+SPM_PAGESIZE*2+6))
 #endif
+#ifdef SUPPORT_EEPROM
+/* Ring buffer of EEPROM writes that haven't been started yet.  The    */
+/* head and tail live in GPIOR1 and GPIOR2, which are zero after reset. */
+#if defined(VIRTUAL_BOOT_PARTITION) || !defined(GPIOR2)
+#error SUPPORT_EEPROM is not supported on this target
+#endif
+#define eeQueueData ((uint8_t*)(RAMSTART+0x100))
+#define eeQueueAddr ((uint16_t*)(RAMSTART+0x200))
+#define eeQueueHead GPIOR1
+#define eeQueueTail GPIOR2
+#endif
 
 // ATmega328PB signature byte
 #ifdef REALLY_328PB
@@ -266,6 +540,13 @@ void appStart() __attribute__ ((naked));
 #define SIGNATURE_2 0x16
 #endif
 
+#ifdef UPLOAD_STATS
+// Time the SPM waits of the command loop.  Only main() uses this: the
+// application's RAM must be left alone when do_spm() waits.
+#undef boot_spm_busy_wait
+#define boot_spm_busy_wait() statsSpmWait()
+#endif
+
 /* main program starts here */
 int main(void) {
   uint8_t ch;
@@ -296,7 +577,24 @@ int main(void) {
   // Adaboot no-wait mod
   ch = MCUSR;
   MCUSR = 0;
+#ifdef BOOT_TIMING
+  // Start from 1, so that a time taken straight away isn't "not reached"
+  TCNT3 = 1;
+  TCCR3B = _BV(CS31); // div 8
+  bootTiming.overflows = 0;
+  if ((ch & _BV(EXTRF)) || bootTiming.magic != BOOT_TIMING_MAGIC) {
+    bootTiming.magic = BOOT_TIMING_MAGIC;
+    bootTiming.uart = 0;
+    bootTiming.command = 0;
+  }
+  bootTiming.mcusr = ch;
+#endif
+#ifdef AB_SLOTS
+  // Falls through to the bootloader if neither slot holds a good image
+  if (!(ch & _BV(EXTRF))) abStart();
+#else
   if (!(ch & _BV(EXTRF))) appStart();
+#endif
 
 #if LED_START_FLASHES > 0
   // Set up Timer 1 for timeout counter
@@ -312,10 +610,14 @@ int main(void) {
   UBRRL = (uint8_t)( (F_CPU + BAUD_RATE * 4L) / (BAUD_RATE * 8L) - 1 );
 #else
   UCSR0A = _BV(U2X0); //Double speed mode USART0
+#ifndef AUTOBAUD
   UCSR0B = _BV(RXEN0) | _BV(TXEN0);
+#endif
   UCSR0C = _BV(UCSZ00) | _BV(UCSZ01);
+#ifndef AUTOBAUD
   UBRR0L = (uint8_t)( (F_CPU + BAUD_RATE * 4L) / (BAUD_RATE * 8L) - 1 );
 #endif
+#endif
 #endif
 
   // Set up watchdog to trigger after 500ms
@@ -334,10 +636,81 @@ int main(void) {
   flash_led(LED_START_FLASHES * 2);
 #endif
 
+#ifdef AUTOBAUD
+  {
+    uint16_t bitTime5;
+    uint16_t idleTime;
+
+    TCCR1B = _BV(CS10); // div 1
+
+    // Wait for the line to be idle so we don't start in the middle of a byte
+    TCNT1 = 0;
+    while (TCNT1 < AUTOBAUD_IDLE) {
+      if (!(PIND & _BV(0))) TCNT1 = 0;
+#ifdef BOOT_TIMING
+      bootTimingPoll();
+#endif
+    }
+
+    // STK_GET_SYNC ('0') starts with the start bit and four 0 bits, so the
+    // first low period on the line is five bit times long.
+    while (PIND & _BV(0)) {
+#ifdef BOOT_TIMING
+      bootTimingPoll();
+#endif
+    }
+    TCNT1 = 0;
+    while (!(PIND & _BV(0)));
+    bitTime5 = TCNT1;
+    idleTime = bitTime5 << 2;
+
+    // UBRR = F_CPU / (8 * baud) - 1 = bitTime5 / 40 - 1, rounded.
+    // libgcc isn't linked, so divide by repeated subtraction.
+    bitTime5 += 20;
+    ch = 0;
+    while (bitTime5 >= 40) {
+      bitTime5 -= 40;
+      ch++;
+    }
+    UBRR0L = ch - 1;
+
+    // Let the rest of this sync command go by (20 bit times of idle line)
+    // before turning on the receiver; avrdude sends STK_GET_SYNC again when
+    // it gets no reply.
+    TCNT1 = 0;
+    while (TCNT1 < idleTime) {
+      if (!(PIND & _BV(0))) TCNT1 = 0;
+#ifdef BOOT_TIMING
+      bootTimingPoll();
+#endif
+    }
+
+    UCSR0B = _BV(RXEN0) | _BV(TXEN0);
+  }
+#endif
+
+#ifdef BOOT_TIMING
+  bootTiming.uart = bootTimingNow();
+#endif
+
+#ifdef UPLOAD_STATS
+  // Timer1 is done with the LED flashes and autobaud, so it can time SPM
+  TCCR1B = _BV(CS11) | _BV(CS10); // div 64
+  {
+    uint8_t *p = (uint8_t *)&stats;
+    ch = sizeof(stats);
+    do *p++ = 0;
+    while (--ch);
+  }
+#endif
+
   /* Forever loop */
   for (;;) {
     /* get character from UART */
     ch = getch();
+#ifdef BOOT_TIMING
+    if (!bootTiming.command) bootTiming.command = bootTimingNow();
+#endif
 
     if(ch == STK_GET_PARAMETER) {
       unsigned char which = getch();
@@ -385,14 +758,102 @@ int main(void) {
     }
     /* Write memory, length is big endian and is in bytes */
     else if(ch == STK_PROG_PAGE) {
-      // PROGRAM PAGE - we support flash programming only, not EEPROM
+      // PROGRAM PAGE - flash, or EEPROM if SUPPORT_EEPROM is defined
       uint8_t *bufPtr;
       uint16_t addrPtr;
 
       getch();			/* getlen() */
       length = getch();
+#ifdef SUPPORT_EEPROM
+      ch = getch();		/* memory type */
+
+      if (ch == 'E') {
+        // Read in the whole block first: queueing a write can stall until
+        // the EEPROM is free, and the UART can't wait for that.
+        ch = length;
+        bufPtr = buff;
+        do *bufPtr++ = getch();
+        while (--length);
+
+        // Read command terminator, start reply
+        verifySpace();
+
+        // The queued writes are done while the host sends the next block.
+        // LOAD ADDRESS doubled the EEPROM byte address, so undo that.
+        bufPtr = buff;
+        addrPtr = address >> 1;
+        do eepromQueue(addrPtr++, *bufPtr++);
+        while (--ch);
+      } else {
+      // SPM can't be started while an EEPROM write is in progress, but
+      // queued writes are only flushed once the page has been received:
+      // the UART can't wait for them.
+#elif defined(DELTA_PAGES)
+      ch = getch();		/* memory type */
+#else
       getch();
+#endif
 
+#if defined(SKIP_UNCHANGED_PAGES)
+      // Nothing can be erased until the page has been compared with flash
+#ifdef DELTA_PAGES
+      // A delta page is kept aside until flash can be read to apply it
+      bufPtr = (ch == 'D') ? deltaBuff : buff;
+#else
+      bufPtr = buff;
+#endif
+      do *bufPtr++ = getch();
+      while (--length);
+#ifdef SUPPORT_EEPROM
+      eepromFlush();
+#endif
+#elif defined(PIPELINE_PAGES)
+      // The write of the previous page may still be in progress, so the
+      // erase of an RWW page is started from the receive loop as soon as
+      // the SPM unit is free.  ch flags an erase that is still pending.
+      ch = (address < NRWWSTART);
+      bufPtr = buff;
+      do {
+#ifdef SUPPORT_EEPROM
+        if (ch && !boot_spm_busy() && !(EECR & _BV(EEPE))) {
+#else
+        if (ch && !boot_spm_busy()) {
+#endif
+          __boot_page_erase_short((uint16_t)(void*)address);
+          ch = 0;
+        }
+        *bufPtr++ = getch();
+      } while (--length);
+#ifdef SUPPORT_EEPROM
+      eepromFlush();
+#endif
+
+      // If we are in NRWW section, or the previous write outlasted the
+      // page data, page erase has to be done now.
+      // Todo: Take RAMPZ into account
+      if (ch || address >= NRWWSTART) {
+        boot_spm_busy_wait();
+        __boot_page_erase_short((uint16_t)(void*)address);
+      }
+#elif defined(SUPPORT_EEPROM)
+      // As below, but the early erase has to wait if an EEPROM write is
+      // running.  ch flags an erase that is still to be done.
+      ch = 1;
+      if (address < NRWWSTART && !(EECR & _BV(EEPE))) {
+        __boot_page_erase_short((uint16_t)(void*)address);
+        ch = 0;
+      }
+
+      bufPtr = buff;
+      do *bufPtr++ = getch();
+      while (--length);
+
+      eepromFlush();
+      if (ch) {
+        boot_spm_busy_wait();
+        __boot_page_erase_short((uint16_t)(void*)address);
+      }
+#else
       // If we are in RWW section, immediately start page erase
       if (address < NRWWSTART) __boot_page_erase_short((uint16_t)(void*)address);
 
@@ -404,10 +865,69 @@ int main(void) {
       // If we are in NRWW section, page erase has to be delayed until now.
       // Todo: Take RAMPZ into account
       if (address >= NRWWSTART) __boot_page_erase_short((uint16_t)(void*)address);
+#endif
 
       // Read command terminator, start reply
       verifySpace();
 
+#ifdef SKIP_UNCHANGED_PAGES
+      // Make sure the RWW section is readable
+      boot_spm_busy_wait();
+#if defined(RWWSRE)
+      boot_rww_enable();
+#endif
+
+#ifdef DELTA_PAGES
+      if (ch == 'D') {
+        // Build the page in buff from the patch, which ends at bufPtr
+        uint8_t *patchPtr = deltaBuff;
+        uint8_t *outPtr = buff;
+
+        while (patchPtr < bufPtr) {
+          uint8_t op = *patchPtr++;
+          length = (op & 0x7f) + 1;
+          // Stop on an op that would overrun the page, or whose address
+          // or literal bytes run past the end of the patch
+          if (outPtr + length > buff + SPM_PAGESIZE ||
+              patchPtr + ((op & 0x80) ? 2 : length) > bufPtr) {
+            outPtr = buff;
+            break;
+          }
+          if (op & 0x80) {
+            addrPtr = *patchPtr++ << 8;
+            addrPtr |= *patchPtr++;
+            do *outPtr++ = pgm_read_byte_near(addrPtr++);
+            while (--length);
+          } else {
+            do *outPtr++ = *patchPtr++;
+            while (--length);
+          }
+        }
+
+        // A patch that is cut short or doesn't make exactly one page
+        // aborts the upload through a watchdog reset, like a bad command
+        // does.
+        if (outPtr != buff + SPM_PAGESIZE) {
+          watchdogConfig(WATCHDOG_16MS);
+          while (1)
+            ;
+        }
+      }
+#endif
+
+      // Look for a byte that differs from what is already in flash
+      bufPtr = buff;
+      addrPtr = (uint16_t)(void*)address;
+      ch = SPM_PAGESIZE;
+      do {
+        if (*bufPtr++ != pgm_read_byte_near(addrPtr++)) break;
+      } while (--ch);
+
+      // Only erase and write the page if it has changed
+      if (ch) {
+      __boot_page_erase_short((uint16_t)(void*)address);
+#endif
+
       // If only a partial page is to be programmed, the erase might not be complete.
       // So check that here
       boot_spm_busy_wait();
@@ -445,23 +965,180 @@ int main(void) {
 
       // Write from programming buffer
       __boot_page_write_short((uint16_t)(void*)address);
+#ifdef UPLOAD_STATS
+      stats.pages++;
+#endif
+#ifndef PIPELINE_PAGES
       boot_spm_busy_wait();
 
 #if defined(RWWSRE)
       // Reenable read access to flash
       boot_rww_enable();
 #endif
+#endif
+#ifdef SKIP_UNCHANGED_PAGES
+      }
+#endif
+#ifdef AB_SLOTS
+      if (!address) abDropRecord();
+#endif
+#ifdef SUPPORT_EEPROM
+      }
+#endif
+
+    }
+#ifdef STREAM_PAGES
+    /* Write a run of flash pages, length is a page count */
+    else if(ch == STK_PROG_STREAM) {
+      // Pages are received alternately into buff and streamBuff.  Between
+      // bytes, the SPM work of the previous page is moved along one step
+      // at a time: fill one word of the SPM page buffer, then erase (the
+      // page buffer survives that), then write.  Nothing here waits for
+      // SPM, so the UART is never left unread.
+      uint8_t *bufPtr = buff;
+      uint8_t *fillPtr = 0;       // page being copied to the page buffer
+      uint16_t fillAddr = 0;
+      uint16_t writeAddr = 0;     // page being erased, to be written next
+      uint8_t writePending = 0;
+      uint8_t left = SPM_PAGESIZE;  // bytes still to come for this page
+
+      length = getch();
+
+      // RWW pages only: an NRWW erase or write would halt the CPU while
+      // the host is still sending.  STK_INSYNC tells the host to start
+      // sending pages, so a rejected run gets STK_FAILED instead.
+      if (address >= NRWWSTART ||
+          (uint8_t)(length - 1) >= (NRWWSTART - address) / SPM_PAGESIZE) {
+        getch();  // CRC_EOP
+        putch(STK_FAILED);
+        continue;
+      }
+
+      // Everything that can hold up the loop below is done before the
+      // host is told to start.
+#ifdef AB_SLOTS
+      if (!address) abDropRecord();
+#endif
+#ifdef SUPPORT_EEPROM
+      // SPM is not executed while an EEPROM write is in progress
+      eepromFlush();
+#endif
+      verifySpace();
 
+      for (;;) {
+        watchdogReset();
+        if (!boot_spm_busy()) {
+          if (writePending) {
+            __boot_page_write_short(writeAddr);
+            writePending = 0;
+#ifdef UPLOAD_STATS
+            stats.pages++;
+#endif
+          } else if (fillPtr) {
+            __boot_page_fill_short(fillAddr, fillPtr[0] | (fillPtr[1] << 8));
+            fillPtr += 2;
+            fillAddr += 2;
+            if (!(fillAddr & (SPM_PAGESIZE - 1))) {
+              writeAddr = fillAddr - SPM_PAGESIZE;
+              __boot_page_erase_short(writeAddr);
+              writePending = 1;
+              fillPtr = 0;
+              // The buffer is free again, so the host may send one more page
+              putch(STK_INSYNC);
+            }
+          }
+        }
+        if (left) {
+          *bufPtr++ = getch();
+          --left;
+        } else if (length && !fillPtr) {
+          // Hand the received page over and start on the next one
+          fillPtr = bufPtr - SPM_PAGESIZE;
+          fillAddr = address;
+          address += SPM_PAGESIZE;
+          bufPtr = (fillPtr == buff) ? streamBuff : buff;
+          if (--length) left = SPM_PAGESIZE;
+        } else if (!length && !fillPtr && !writePending) {
+          break;
+        }
+      }
+
+      boot_spm_busy_wait();
+#if defined(RWWSRE)
+      // Reenable read access to flash
+      boot_rww_enable();
+#endif
     }
+#endif
     /* Read memory block mode, length is big endian.  */
     else if(ch == STK_READ_PAGE) {
-      // READ PAGE - we only read flash
+      // READ PAGE - flash, or EEPROM if SUPPORT_EEPROM is defined
+#ifdef BULK_READ
+      uint16_t readLength;
+
+      readLength = getch() << 8;
+      readLength |= getch();
+      length = readLength;
+      ch = getch();		/* memory type */
+#else
       getch();			/* getlen() */
       length = getch();
+#ifdef SUPPORT_EEPROM
+      ch = getch();		/* memory type */
+#else
       getch();
+#endif
+#endif
 
       verifySpace();
-#ifdef VIRTUAL_BOOT_PARTITION
+#ifdef SUPPORT_EEPROM
+      if (ch == 'E') {
+        // Let queued writes finish, then read the EEPROM directly
+        eepromFlush();
+        do {
+          EEAR = address >> 1;
+          EECR |= _BV(EERE);
+          putch(EEDR);
+          address += 2;
+        } while (--length);
+      } else {
+#endif
+#ifdef PIPELINE_PAGES
+      // Let a background page write finish before reading flash back
+      boot_spm_busy_wait();
+#if defined(RWWSRE)
+      boot_rww_enable();
+#endif
+#endif
+#if defined(BULK_READ)
+      uint8_t run = 0;  // 0xFF bytes not sent yet
+
+      do {
+        uint8_t data = pgm_read_byte_near(address++);
+
+        // A whole-chip read takes several watchdog periods
+        watchdogReset();
+        if (ch == 'R' && data == 0xff) {
+          // A full run of 256 is sent as soon as it is complete
+          if (!++run) {
+            putch(0xff);
+            putch(0xff);
+          }
+        } else {
+          if (run) {
+            putch(0xff);
+            putch(run - 1);
+            run = 0;
+          }
+          putch(data);
+        }
+      } while (--readLength);
+
+      if (run) {
+        putch(0xff);
+        putch(run - 1);
+      }
+#elif defined(VIRTUAL_BOOT_PARTITION)
       do {
         // Undo vector patch in bottom page so verify passes
         if (address == 0)       ch=rstVect & 0xff;
@@ -488,7 +1165,54 @@ int main(void) {
       while (--length);
 #endif
 #endif
+#ifdef SUPPORT_EEPROM
+      }
+#endif
+    }
+#ifdef FLASH_CRC_SUPPORT
+    /* CRC of a flash block, length is big endian and is in bytes */
+    else if(ch == STK_CRC_FLASH) {
+      // Like READ PAGE, this starts at the loaded address and leaves the
+      // address after the block.  The CRC is CRC-16/MODBUS (polynomial
+      // 0xA001 reflected, initial value 0xFFFF), sent high byte first.
+      // A length of 0 is an empty block, so the CRC is 0xFFFF, as it is
+      // with Caterina; bootloaders/crc16.py is the host reference.
+      uint16_t crcLength;
+      uint16_t crc = 0xffff;
+
+      crcLength = getch() << 8;
+      crcLength |= getch();
+
+      verifySpace();
+
+      // Make sure a page write has finished and the RWW section is readable
+      boot_spm_busy_wait();
+#if defined(RWWSRE)
+      boot_rww_enable();
+#endif
+
+      while (crcLength--) {
+        crc = _crc16_update(crc, pgm_read_byte_near(address++));
+#ifdef BOOT_TIMING
+        bootTimingPoll();
+#endif
+      }
+
+      putch(crc >> 8);
+      putch(crc);
+    }
+#endif
+#ifdef UPLOAD_STATS
+    /* Upload counters, in memory order */
+    else if(ch == STK_UPLOAD_STATS) {
+      uint8_t *p = (uint8_t *)&stats;
+
+      verifySpace();
+      ch = sizeof(stats);
+      do putch(*p++);
+      while (--ch);
     }
+#endif
 
     /* Get device signature bytes  */
     else if(ch == STK_READ_SIGN) {
@@ -499,6 +1223,14 @@ int main(void) {
       putch(SIGNATURE_2);
     }
     else if (ch == 'Q') {
+#ifdef PIPELINE_PAGES
+      // Don't let the watchdog reset interrupt the last page write
+      boot_spm_busy_wait();
+#endif
+#ifdef SUPPORT_EEPROM
+      // Finish the queued EEPROM writes before the watchdog reset
+      eepromFlush();
+#endif
       // Adaboot no-wait mod
       watchdogConfig(WATCHDOG_16MS);
       verifySpace();
@@ -511,9 +1243,25 @@ int main(void) {
   }
 }
 
+#ifdef UPLOAD_STATS
+#undef boot_spm_busy_wait
+#define boot_spm_busy_wait() do{}while(boot_spm_busy())
+
+void statsSpmWait() {
+  uint16_t start = TCNT1;
+
+  boot_spm_busy_wait();
+  stats.spmTicks += (uint16_t)(TCNT1 - start);
+}
+#endif
+
 void putch(char ch) {
 #ifndef SOFT_UART
-  while (!(UCSR0A & _BV(UDRE0)));
+  while (!(UCSR0A & _BV(UDRE0))) {
+#ifdef BOOT_TIMING
+    bootTimingPoll();
+#endif
+  }
   UDR0 = ch;
 #else
   __asm__ __volatile__ (
@@ -577,8 +1325,21 @@ uint8_t getch(void) {
       "r25"
 );
 #else
-  while(!(UCSR0A & _BV(RXC0)))
-    ;
+  while(!(UCSR0A & _BV(RXC0))) {
+#ifdef UPLOAD_STATS
+    stats.rxPolls++;
+#endif
+#ifdef SUPPORT_EEPROM
+    eepromService();
+#endif
+#ifdef BOOT_TIMING
+    bootTimingPoll();
+#endif
+  }
+#ifdef UPLOAD_STATS
+  stats.bytes++;
+  if (UCSR0A & _BV(FE0)) stats.framingErrors++;
+#endif
   if (!(UCSR0A & _BV(FE0))) {
       /*
        * A Framing Error indicates (probably) that something is talking
@@ -643,7 +1404,11 @@ void flash_led(uint8_t count) {
   do {
     TCNT1 = -(F_CPU/(1024*16));
     TIFR1 = _BV(TOV1);
-    while(!(TIFR1 & _BV(TOV1)));
+    while(!(TIFR1 & _BV(TOV1))) {
+#ifdef BOOT_TIMING
+      bootTimingPoll();
+#endif
+    }
 #ifdef __AVR_ATmega8__
     LED_PORT ^= _BV(LED);
 #else
@@ -666,7 +1431,193 @@ void watchdogConfig(uint8_t x) {
   WDTCSR = x;
 }
 
+#ifdef SUPPORT_EEPROM
+// Start the next queued EEPROM write if neither the EEPROM nor SPM is busy.
+void eepromService() {
+  uint8_t tail = eeQueueTail;
+
+  if (tail != eeQueueHead && !(EECR & _BV(EEPE)) && !boot_spm_busy()) {
+    EEAR = eeQueueAddr[tail];
+    EEDR = eeQueueData[tail];
+    EECR = _BV(EEMPE);  // Atomic erase and write
+    EECR |= _BV(EEPE);
+    eeQueueTail = tail + 1;
+  }
+}
+
+// Add a write to the queue, waiting for a free slot if it is full.  One
+// slot is always left empty so a full queue can be told from an empty one.
+void eepromQueue(uint16_t addr, uint8_t data) {
+  uint8_t head = eeQueueHead;
+
+  while ((uint8_t)(head + 1) == eeQueueTail) {
+    watchdogReset();
+    eepromService();
+  }
+  eeQueueAddr[head] = addr;
+  eeQueueData[head] = data;
+  eeQueueHead = head + 1;
+}
+
+// Wait for every queued EEPROM write to be done.
+void eepromFlush() {
+  while (eeQueueHead != eeQueueTail || (EECR & _BV(EEPE))) {
+    watchdogReset();
+    eepromService();
+  }
+}
+#endif
+
+#ifdef SPM_API
+// Self-programming for applications, called through the jump in .spmapi.
+// command is __BOOT_PAGE_FILL, __BOOT_PAGE_ERASE or __BOOT_PAGE_WRITE;
+// anything else is ignored.  Erases and writes are finished, and the RWW
+// section made readable again, before returning.  Interrupts are kept off
+// until then, as the application's vectors and code may be in the RWW
+// section.  The lock bits stop the bootloader itself from being written.
+void do_spm(uint16_t address, uint8_t command, uint16_t data) {
+  uint8_t sreg = SREG;
+
+  __asm__ __volatile__ ("cli\n");
+
+  // SPM can't be started while an EEPROM write is in progress
+  while (EECR & _BV(EEPE));
+  boot_spm_busy_wait();
+
+  if (command == __BOOT_PAGE_FILL) {
+    __boot_page_fill_short(address, data);
+  } else if (command == __BOOT_PAGE_ERASE || command == __BOOT_PAGE_WRITE) {
+    if (command == __BOOT_PAGE_ERASE) __boot_page_erase_short(address);
+    else __boot_page_write_short(address);
+    boot_spm_busy_wait();
+#if defined(RWWSRE)
+    boot_rww_enable();
+#endif
+  }
+
+  SREG = sreg;
+}
+#endif
+
+#ifdef BOOT_TIMING
+// Count a Timer3 overflow, if there has been one since the last call.
+void bootTimingPoll() {
+  if (TIFR3 & _BV(TOV3)) {
+    TIFR3 = _BV(TOV3);
+    bootTiming.overflows++;
+  }
+}
+
+// The time since reset.  An overflow that bootTimingPoll() hasn't counted
+// yet belongs to this reading if it came before TCNT3 was read, which it
+// did if TCNT3 is still in its lower half.
+uint32_t bootTimingNow() {
+  uint16_t ticks = TCNT3;
+  uint16_t overflows = bootTiming.overflows;
+
+  if ((TIFR3 & _BV(TOV3)) && !(ticks & 0x8000)) overflows++;
+  return ((uint32_t)overflows << 16) | ticks;
+}
+
+// Note the application start time and give Timer3 back to the
+// application the way reset left it.
+static inline void bootTimingStop() {
+  bootTiming.appStart = bootTimingNow();
+  TCCR3B = 0;
+  TCNT3 = 0;
+  TIFR3 = _BV(TOV3);
+}
+#endif
+
+#ifdef AB_SLOTS
+// Pick the slot to run: the one named in the boot record if its CRC
+// checks out, otherwise the other one.  Make sure the vector table at
+// address 0 is that slot's, and start it.  Without a boot record, the
+// application at address 0 is started as usual.  Returns if no slot
+// holds a good image.
+void abStart() {
+  uint8_t slot;
+  uint8_t tries = 2;
+
+  // A reset by the watchdog leaves it running, and the CRC takes a while
+  watchdogConfig(WATCHDOG_OFF);
+
+  if (pgm_read_word_near(AB_RECORD) != AB_MAGIC) {
+#ifdef BOOT_TIMING
+    bootTimingStop();
+#endif
+    appStart(0);
+  }
+
+  slot = pgm_read_byte_near(AB_RECORD + 2);
+  do {
+    uint16_t base = slot ? AB_SLOT_B : AB_SLOT_A;
+    uint16_t entry = AB_RECORD + (slot ? 8 : 4);
+    uint16_t length = pgm_read_word_near(entry);
+    uint16_t crc = 0xffff;
+    uint16_t addr = base;
+
+    if (length && length <= AB_SLOT_SIZE) {
+      do {
+        crc = _crc16_update(crc, pgm_read_byte_near(addr++));
+#ifdef BOOT_TIMING
+        bootTimingPoll();
+#endif
+      } while (--length);
+
+      if (crc == pgm_read_word_near(entry + 2)) {
+        // Compare the vector table with the slot's, and copy it over if
+        // they differ.  A copy cut short by a reset is redone next time.
+        for (addr = 0; addr < AB_VECTORS; addr++) {
+          if (pgm_read_byte_near(addr) != pgm_read_byte_near(base + addr)) break;
+        }
+        if (addr < AB_VECTORS) {
+          for (addr = 0; addr < AB_VECTORS; addr += SPM_PAGESIZE) {
+            // Fill the page buffer first: the slot can't be read while
+            // the page is being erased, and the buffer survives that.
+            for (length = 0; length < SPM_PAGESIZE; length += 2)
+              __boot_page_fill_short(addr + length, pgm_read_word_near(base + addr + length));
+            __boot_page_erase_short(addr);
+            boot_spm_busy_wait();
+            __boot_page_write_short(addr);
+            boot_spm_busy_wait();
+            boot_rww_enable();
+          }
+        }
+#ifdef BOOT_TIMING
+        bootTimingStop();
+#endif
+        appStart(base >> 1);
+      }
+    }
+    slot = !slot;
+  } while (--tries);
+}
+
+// Erase the boot record, for when a plain image is written from address 0.
+void abDropRecord() {
+#ifdef SUPPORT_EEPROM
+  eepromFlush();
+#endif
+  boot_spm_busy_wait();
+  __boot_page_erase_short(AB_RECORD);
+  boot_spm_busy_wait();
+  boot_rww_enable();
+}
+
+// Jump to the reset vector at the word address in r25:r24.  abStart()
+// has already turned the watchdog off.
+void appStart(uint16_t vector) {
+  __asm__ __volatile__ (
+    "movw r30,r24\n"
+    "ijmp\n"
+  );
+}
+#else
 void appStart() {
+#ifdef BOOT_TIMING
+  bootTimingStop();
+#endif
   watchdogConfig(WATCHDOG_OFF);
   __asm__ __volatile__ (
 #ifdef VIRTUAL_BOOT_PARTITION
@@ -681,3 +1632,4 @@ void appStart() {
     "ijmp\n"
   );
 }
+#endif
@@ -0,0 +1,1505 @@
+#!/usr/bin/env python3
+"""Uploads an image to an Optiboot build in a simulated ATmega328P(B).
+
+The bootloader .hex is run on an instruction-level model of the AVR core
+with the parts of the chip Optiboot uses: USART0 (with its two-byte receive
+FIFO, so overruns show up), Timer1 and Timer3, the watchdog, the EEPROM and
+self-programming, including the RWW/NRWW split and the time page erases and
+writes take.  A model of avrdude's "arduino" programmer drives the STK500
+protocol over the simulated serial line: it syncs, writes the image page by
+page, reads it back to verify it and leaves programming mode.
+
+For each build it reports the bytes sent and received, the cycles the
+bootloader spent waiting for SPM to finish, and the cycles from the first
+sync reply to the reply to STK_LEAVE_PROGMODE (the reset and the LED
+flashes before that are not counted).  It then checks the simulated flash
+against the image.  This makes protocol and throughput changes measurable
+without a board:
+
+    python3 simulate.py optiboot_atmega328pb_16mhz.hex 16000000 115200 \\
+                        optiboot_atmega328pb_8mhz.hex 8000000 57600
+
+"make simulate" does this for the four atmega328pb_*mhz builds.  The
+image is random data filling the application section unless --image gives
+a sketch .hex; --latency adds a USB serial adapter's turnaround time to
+each reply.  --stream writes with the STREAM_PAGES 'y' command instead of
+a PROG_PAGE per page ("make simulate_fast" does this for the *_fast
+builds).  upload.py runs the same host side over a real serial port.
+
+SPM waits are the cycles between a read of SPMCSR that finds SPMEN set and
+the next read that finds it clear, with no UART access in between, plus
+the time the CPU is halted by an NRWW erase or write.  A loop that polls
+the UART while SPM runs in the background is not waiting.
+"""
+
+import argparse
+import collections
+import math
+import random
+import sys
+
+FLASH_SIZE = 0x8000
+RAM_END = 0x8FF
+PAGE_SIZE = 128
+NRWW_START = 0x7000
+
+SPM_TIME = 4.5e-3     # page erase or write, datasheet maximum
+EEPROM_TIME = 3.4e-3  # EEPROM erase and write
+WDT_CLOCK = 128000
+
+# Data space addresses of the registers that are modelled
+PINB, PINC, PIND, PINE = 0x23, 0x26, 0x29, 0x2C
+TIFR1, TIFR3 = 0x36, 0x38
+EECR, EEDR, EEARL, EEARH = 0x3F, 0x40, 0x41, 0x42
+MCUSR, SPMCSR = 0x54, 0x57
+SPL, SPH, SREG = 0x5D, 0x5E, 0x5F
+WDTCSR = 0x60
+TCCR1B, TCNT1L, TCNT1H = 0x81, 0x84, 0x85
+TCCR3B, TCNT3L, TCNT3H = 0x91, 0x94, 0x95
+UCSR0A, UCSR0B, UBRR0L, UBRR0H, UDR0 = 0xC0, 0xC1, 0xC4, 0xC5, 0xC6
+
+# Registers whose value only changes at a scheduled event, so a loop that
+# does nothing but poll one of them can be skipped ahead to the next event.
+EVENT_REGISTERS = (UCSR0A, SPMCSR, EECR, TIFR1, TIFR3)
+
+# SBI and CBI on these write only the one bit instead of read-modify-write
+SINGLE_BIT_REGISTERS = (PINB, PINC, PIND, PINE, TIFR1, TIFR3)
+
+STK_OK = 0x10
+STK_INSYNC = 0x14
+STK_PROG_STREAM = 0x79
+CRC_EOP = 0x20
+
+
+class SimError(Exception):
+    pass
+
+
+def _flag_tables():
+    """Result and H S V N Z C flags of ADD/ADC and SUB/SBC, indexed by
+    carry << 16 | a << 8 | b, packed as flags << 8 | result."""
+    add = [0] * 0x20000
+    sub = [0] * 0x20000
+    for carry in (0, 1):
+        for a in range(256):
+            for b in range(256):
+                i = carry << 16 | a << 8 | b
+
+                r = a + b + carry
+                c = r >> 8
+                r &= 0xFF
+                h = ((a & 0xF) + (b & 0xF) + carry) >> 4
+                v = (~(a ^ b) & (a ^ r) & 0x80) >> 7
+                n = r >> 7
+                s = n ^ v
+                add[i] = (h << 5 | s << 4 | v << 3 | n << 2 | (r == 0) << 1 | c) << 8 | r
+
+                r = a - b - carry
+                c = 1 if r < 0 else 0
+                r &= 0xFF
+                h = 1 if (a & 0xF) - (b & 0xF) - carry < 0 else 0
+                v = ((a ^ b) & (a ^ r) & 0x80) >> 7
+                n = r >> 7
+                s = n ^ v
+                sub[i] = (h << 5 | s << 4 | v << 3 | n << 2 | (r == 0) << 1 | c) << 8 | r
+    return add, sub
+
+
+ADD_TABLE, SUB_TABLE = _flag_tables()
+
+# S V N Z for the logic instructions, which clear V
+LOGIC_TABLE = [((r >> 7) << 4 | (r >> 7) << 2 | (r == 0) << 1) for r in range(256)]
+
+
+def read_hex(path, fill=0xFF):
+    """Returns a FLASH_SIZE bytearray and the lowest and highest addresses
+    used by an Intel hex file."""
+    flash = bytearray([fill]) * FLASH_SIZE
+    low, high = FLASH_SIZE, 0
+    base = 0
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if not line.startswith(':'):
+                continue
+            rec = bytes.fromhex(line[1:])
+            if sum(rec) & 0xFF:
+                raise SimError('%s: bad checksum' % path)
+            count, addr, kind = rec[0], rec[1] << 8 | rec[2], rec[3]
+            data = rec[4:4 + count]
+            if kind == 0:
+                addr += base
+                if addr + count > FLASH_SIZE:
+                    raise SimError('%s: data past the end of flash' % path)
+                flash[addr:addr + count] = data
+                low = min(low, addr)
+                high = max(high, addr + count)
+            elif kind == 2:
+                base = (data[0] << 8 | data[1]) << 4
+            elif kind == 4:
+                base = (data[0] << 8 | data[1]) << 16
+            elif kind == 1:
+                break
+    return flash, low, high
+
+
+class Timer16(object):
+    """Timer1 or Timer3 in normal mode: counts up from the shared
+    prescaler and sets TOVn when it wraps."""
+
+    DIVIDERS = (0, 1, 8, 64, 256, 1024, 0, 0)
+
+    def __init__(self, sim, tccrb, tifr):
+        self.sim = sim
+        self.tccrb = tccrb
+        self.tifr = tifr
+        self.count = 0
+        self.last = 0
+        self.temp = 0
+
+    def divider(self):
+        return self.DIVIDERS[self.sim.d[self.tccrb] & 7]
+
+    def update(self, now=None):
+        if now is None:
+            now = self.sim.cycles
+        div = self.divider()
+        if div:
+            n = self.count + now // div - self.last // div
+            if n > 0xFFFF:
+                self.sim.d[self.tifr] |= 1
+                n &= 0xFFFF
+            self.count = n
+        self.last = now
+
+    def next_overflow(self):
+        div = self.divider()
+        if not div:
+            return None
+        return (self.last // div + 0x10000 - self.count) * div
+
+
+class Simulator(object):
+    def __init__(self, bootloader, f_cpu, baud, latency=0.0):
+        self.flash, self.boot_start, boot_end = read_hex(bootloader)
+        if boot_end > FLASH_SIZE or self.boot_start < NRWW_START:
+            raise SimError('%s does not look like a bootloader' % bootloader)
+        self.f_cpu = f_cpu
+        self.baud = baud
+        self.latency = latency * f_cpu
+
+        self.d = bytearray(RAM_END + 1)
+        self.d[SPL] = RAM_END & 0xFF
+        self.d[SPH] = RAM_END >> 8
+        self.d[MCUSR] = 0x02  # EXTRF: the host has just reset the board
+        self.d[UCSR0A] = 0x20  # UDRE0
+        self.eeprom = bytearray([0xFF]) * 1024
+        self.pc = self.boot_start >> 1
+        self.cycles = 0
+        self.next_event = 0
+        self.code = [None] * (FLASH_SIZE >> 1)
+
+        self.timers = (Timer16(self, TCCR1B, TIFR1), Timer16(self, TCCR3B, TIFR3))
+
+        # Self-programming
+        self.page_buffer = [0xFFFF] * (PAGE_SIZE >> 1)
+        self.spm_enable_until = -1
+        self.spm_busy_until = None
+        self.spm_done = None
+        self.rww_busy = False
+        self.spm_wait_start = None
+        self.spm_wait_cycles = 0
+        self.spm_ops = collections.Counter()
+
+        # EEPROM
+        self.eempe_until = -1
+        self.eeprom_busy_until = None
+        self.eeprom_done = None
+
+        # Watchdog
+        self.wdce_until = -1
+        self.wdt_period = None
+        self.wdt_deadline = None
+
+        # Serial line from the host: bytes on the wire as (start, end, byte)
+        self.line = collections.deque()
+        self.line_free = 0.0
+        self.rx_fifo = collections.deque()
+        self.overruns = 0
+        self.framing_errors = 0
+        # and back to the host
+        self.tx_shift_until = None
+        self.tx_shift_byte = None
+        self.tx_buffer = None
+
+        self.host = None
+        self.host_rx = bytearray()
+        self.host_wait = None
+        self.host_resume = None
+        self.host_time = 0.0
+        self.bytes_sent = 0
+        self.bytes_received = 0
+        self.marks = {}
+        self.done = False
+        self.errors = []
+
+        self._setup_io()
+
+    # --- Memory ---------------------------------------------------------
+
+    def _setup_io(self):
+        r = self.io_read = [None] * 0x100
+        w = self.io_write = [None] * 0x100
+
+        r[PIND] = self._read_pind
+        for pin in (PINB, PINC, PIND, PINE):
+            w[pin] = self._toggle_port(pin)
+        r[TIFR1] = self._read_tifr(self.timers[0])
+        r[TIFR3] = self._read_tifr(self.timers[1])
+        w[TIFR1] = self._write_tifr(self.timers[0])
+        w[TIFR3] = self._write_tifr(self.timers[1])
+        r[EECR] = self._read_eecr
+        w[EECR] = self._write_eecr
+        w[MCUSR] = self._write_mcusr
+        r[SPMCSR] = self._read_spmcsr
+        w[SPMCSR] = self._write_spmcsr
+        w[WDTCSR] = self._write_wdtcsr
+        for timer, tccrb, low, high in ((self.timers[0], TCCR1B, TCNT1L, TCNT1H),
+                                        (self.timers[1], TCCR3B, TCNT3L, TCNT3H)):
+            w[tccrb] = self._write_tccrb(timer)
+            r[low] = self._read_tcnt_low(timer)
+            r[high] = self._read_tcnt_high(timer)
+            w[low] = self._write_tcnt_low(timer)
+            w[high] = self._write_tcnt_high(timer)
+        r[UCSR0A] = self._read_ucsr0a
+        w[UCSR0A] = self._write_ucsr0a
+        r[UDR0] = self._read_udr0
+        w[UDR0] = self._write_udr0
+
+    def read(self, a):
+        if a >= 0x100 or a < 0x20:
+            if a > RAM_END:
+                raise SimError('read of 0x%04x at 0x%04x' % (a, self.pc << 1))
+            return self.d[a]
+        f = self.io_read[a]
+        return f() if f else self.d[a]
+
+    def write(self, a, v):
+        if a >= 0x100 or a < 0x20:
+            if a > RAM_END:
+                raise SimError('write of 0x%04x at 0x%04x' % (a, self.pc << 1))
+            self.d[a] = v
+            return
+        f = self.io_write[a]
+        if f:
+            f(v)
+        else:
+            self.d[a] = v
+
+    def lpm(self, z):
+        if self.rww_busy and z < NRWW_START:
+            self.error('LPM from the RWW section at 0x%04x while it is busy' % z)
+            return 0xFF
+        return self.flash[z]
+
+    def error(self, text):
+        text = '%s (pc 0x%04x)' % (text, self.pc << 1)
+        if text not in self.errors:
+            self.errors.append(text)
+
+    # --- Peripherals ----------------------------------------------------
+
+    def _toggle_port(self, pin):
+        def write(v):
+            self.d[pin + 2] ^= v
+        return write
+
+    def _read_pind(self):
+        # Bit 0 is RXD0, which AUTOBAUD times directly
+        level = 1
+        if self.line:
+            start, end, byte = self.line[0]
+            if start <= self.cycles < end:
+                bit = int((self.cycles - start) * self.baud / self.f_cpu)
+                level = 0 if bit == 0 else 1 if bit >= 9 else (byte >> (bit - 1)) & 1
+        return (self.d[PIND] & 0xFE) | level
+
+    def _read_tifr(self, timer):
+        def read():
+            timer.update()
+            return self.d[timer.tifr]
+        return read
+
+    def _write_tifr(self, timer):
+        def write(v):
+            timer.update()
+            self.d[timer.tifr] &= ~v & 0xFF
+        return write
+
+    def _write_tccrb(self, timer):
+        def write(v):
+            timer.update()
+            self.d[timer.tccrb] = v
+            self.schedule()
+        return write
+
+    def _read_tcnt_low(self, timer):
+        def read():
+            timer.update()
+            timer.temp = timer.count >> 8
+            return timer.count & 0xFF
+        return read
+
+    def _read_tcnt_high(self, timer):
+        return lambda: timer.temp
+
+    def _write_tcnt_low(self, timer):
+        def write(v):
+            timer.update()
+            timer.count = timer.temp << 8 | v
+            self.schedule()
+        return write
+
+    def _write_tcnt_high(self, timer):
+        def write(v):
+            timer.temp = v
+        return write
+
+    def _write_mcusr(self, v):
+        self.d[MCUSR] &= v
+
+    def _write_wdtcsr(self, v):
+        if self.cycles <= self.wdce_until:
+            self.d[WDTCSR] = v & 0x6F
+            self.wdce_until = -1
+            if v & 0x08:
+                p = (v & 7) | (v >> 2 & 8)
+                self.wdt_period = int((2048 << p) * self.f_cpu / WDT_CLOCK)
+                self.wdt_deadline = self.cycles + self.wdt_period
+            else:
+                self.wdt_period = self.wdt_deadline = None
+            self.schedule()
+        elif (v & 0x18) == 0x18:
+            self.wdce_until = self.cycles + 4
+            self.d[WDTCSR] |= 0x18
+        else:
+            self.d[WDTCSR] = (self.d[WDTCSR] & 0x08) | (v & 0x47)
+
+    def wdr(self):
+        if self.wdt_period:
+            self.wdt_deadline = self.cycles + self.wdt_period
+            self.schedule()
+
+    def _read_eecr(self):
+        v = self.d[EECR] & 0x39
+        if self.eeprom_busy_until is not None:
+            v |= 0x02
+        if self.cycles <= self.eempe_until:
+            v |= 0x04
+        return v
+
+    def _write_eecr(self, v):
+        self.d[EECR] = v & 0x38
+        addr = (self.d[EEARH] << 8 | self.d[EEARL]) & 0x3FF
+        if v & 0x01 and self.eeprom_busy_until is None:
+            self.d[EEDR] = self.eeprom[addr]
+            self.cycles += 4
+        if v & 0x02:
+            if self.cycles <= self.eempe_until and self.eeprom_busy_until is None:
+                if self.spm_busy_until is not None:
+                    self.error('EEPROM write started while SPM is busy')
+                self.eempe_until = -1
+                self.eeprom_busy_until = self.cycles + int(EEPROM_TIME * self.f_cpu)
+                self.eeprom_done = (addr, self.d[EEDR])
+                self.schedule()
+        elif v & 0x04:
+            self.eempe_until = self.cycles + 4
+
+    def _read_spmcsr(self):
+        v = self.d[SPMCSR] & 0x80
+        if self.rww_busy:
+            v |= 0x40
+        if self.spm_busy_until is not None:
+            v |= 0x01
+            if self.spm_wait_start is None:
+                self.spm_wait_start = self.cycles
+        else:
+            if self.cycles <= self.spm_enable_until:
+                v |= self.d[SPMCSR] & 0x3F
+            if self.spm_wait_start is not None:
+                self.spm_wait_cycles += self.cycles - self.spm_wait_start
+                self.spm_wait_start = None
+        return v
+
+    def _write_spmcsr(self, v):
+        self.d[SPMCSR] = v
+        if v & 0x01:
+            self.spm_enable_until = self.cycles + 4
+
+    def spm(self):
+        d = self.d
+        op = d[SPMCSR] & 0x3F
+        if self.cycles > self.spm_enable_until + 1 or not op & 0x01:
+            self.error('SPM without SPMEN')
+            return
+        self.spm_enable_until = -1
+        z = d[31] << 8 | d[30]
+        if self.spm_busy_until is not None:
+            self.error('SPM while a page erase or write is running')
+            return
+        if op == 0x11:
+            # RWWSRE
+            self.rww_busy = False
+            self.page_buffer = [0xFFFF] * (PAGE_SIZE >> 1)
+            self.spm_ops['rwwsre'] += 1
+            return
+        if op == 0x01:
+            self.page_buffer[(z >> 1) & (PAGE_SIZE // 2 - 1)] = d[1] << 8 | d[0]
+            self.spm_ops['fill'] += 1
+            return
+        if op not in (0x03, 0x05):
+            self.error('unsupported SPM operation 0x%02x' % op)
+            return
+        if self.eeprom_busy_until is not None:
+            self.error('page %s while an EEPROM write is running'
+                       % ('erase' if op == 0x03 else 'write'))
+            return
+        page = z & ~(PAGE_SIZE - 1) & (FLASH_SIZE - 1)
+        if page >= self.boot_start:
+            self.error('SPM on the bootloader at 0x%04x' % page)
+            return
+        if op == 0x03:
+            self.spm_done = (page, None)
+            self.spm_ops['erase'] += 1
+        else:
+            self.spm_done = (page, self.page_buffer)
+            self.page_buffer = [0xFFFF] * (PAGE_SIZE >> 1)
+            self.spm_ops['write'] += 1
+        duration = int(SPM_TIME * self.f_cpu)
+        self.spm_busy_until = self.cycles + duration
+        if page < NRWW_START:
+            self.rww_busy = True
+            self.schedule()
+        else:
+            # The CPU is halted until an NRWW erase or write is done
+            self.spm_wait_cycles += duration
+            self.cycles += duration
+            self.service()
+
+    def _finish_spm(self):
+        page, words = self.spm_done
+        if words is None:
+            self.flash[page:page + PAGE_SIZE] = b'\xff' * PAGE_SIZE
+        else:
+            for i, word in enumerate(words):
+                # Programming can only clear bits
+                self.flash[page + 2 * i] &= word & 0xFF
+                self.flash[page + 2 * i + 1] &= word >> 8
+        for i in range(page >> 1, (page + PAGE_SIZE) >> 1):
+            self.code[i] = None
+        self.spm_busy_until = self.spm_done = None
+
+    def _finish_eeprom(self):
+        addr, value = self.eeprom_done
+        self.eeprom[addr] = value
+        self.eeprom_busy_until = self.eeprom_done = None
+
+    def device_byte_cycles(self):
+        ubrr = (self.d[UBRR0H] << 8 | self.d[UBRR0L]) & 0xFFF
+        return 10 * (8 if self.d[UCSR0A] & 0x02 else 16) * (ubrr + 1)
+
+    def _uart_access(self):
+        self.spm_wait_start = None
+
+    def _read_ucsr0a(self):
+        self._uart_access()
+        v = self.d[UCSR0A] & 0x4B
+        if self.rx_fifo:
+            v |= 0x80
+            if self.rx_fifo[0][1]:
+                v |= 0x10
+        if self.tx_buffer is None:
+            v |= 0x20
+        return v
+
+    def _write_ucsr0a(self, v):
+        self._uart_access()
+        a = self.d[UCSR0A]
+        a = (a & ~0x03 & 0xFF) | (v & 0x03)
+        if v & 0x40:
+            a &= ~0x40 & 0xFF
+        self.d[UCSR0A] = a
+
+    def _read_udr0(self):
+        self._uart_access()
+        if not self.rx_fifo:
+            return 0
+        byte, _ = self.rx_fifo.popleft()
+        self.d[UCSR0A] &= ~0x08 & 0xFF
+        return byte
+
+    def _write_udr0(self, v):
+        self._uart_access()
+        if not self.d[UCSR0B] & 0x08:
+            return
+        if self.tx_shift_until is None:
+            self.tx_shift_byte = v
+            self.tx_shift_until = self.cycles + self.device_byte_cycles()
+            self.schedule()
+        elif self.tx_buffer is None:
+            self.tx_buffer = v
+        else:
+            self.error('UDR0 written while the transmit buffer is full')
+
+    def _receive(self, byte):
+        d = self.d
+        if not d[UCSR0B] & 0x10:
+            return
+        ubrr = (d[UBRR0H] << 8 | d[UBRR0L]) & 0xFFF
+        device_baud = self.f_cpu / ((8 if d[UCSR0A] & 0x02 else 16) * (ubrr + 1))
+        framing = abs(device_baud / self.baud - 1) > 0.045
+        if framing:
+            self.framing_errors += 1
+            byte ^= 0x5A
+        # Two bytes in the FIFO and one in the shift register
+        if len(self.rx_fifo) >= 3:
+            self.overruns += 1
+            d[UCSR0A] |= 0x08
+            return
+        self.rx_fifo.append((byte, framing))
+
+    # --- Host -----------------------------------------------------------
+
+    def _host_send(self, data):
+        byte_time = 10 * self.f_cpu / self.baud
+        for b in data:
+            start = max(self.line_free, self.host_time)
+            self.line.append((start, start + byte_time, b))
+            self.line_free = start + byte_time
+        self.bytes_sent += len(data)
+
+    def _host_run(self, value):
+        while True:
+            try:
+                action = self.host.send(value)
+            except StopIteration:
+                self.done = True
+                return
+            value = None
+            kind = action[0]
+            if kind == 'send':
+                self._host_send(action[1])
+            elif kind == 'drain':
+                del self.host_rx[:]
+            elif kind == 'mark':
+                self.marks[action[1]] = self.host_time
+            elif kind == 'recv':
+                n, timeout = action[1], action[2]
+                if len(self.host_rx) >= n:
+                    value = bytes(self.host_rx[:n])
+                    del self.host_rx[:n]
+                    continue
+                self.host_wait = (n, self.host_time + timeout * self.f_cpu)
+                self.schedule()
+                return
+
+    def _host_receive(self, byte, t):
+        self.host_rx.append(byte)
+        self.bytes_received += 1
+        if self.host_wait and len(self.host_rx) >= self.host_wait[0]:
+            self.host_resume = (t + self.latency, self.host_wait[0])
+            self.host_wait = None
+
+    # --- Events ---------------------------------------------------------
+
+    def _events(self):
+        """The pending (time, handler) pairs."""
+        ev = []
+        if self.line:
+            ev.append((self.line[0][1], self._ev_line))
+        if self.tx_shift_until is not None:
+            ev.append((self.tx_shift_until, self._ev_tx))
+        if self.spm_busy_until is not None:
+            ev.append((self.spm_busy_until, self._ev_spm))
+        if self.eeprom_busy_until is not None:
+            ev.append((self.eeprom_busy_until, self._ev_eeprom))
+        if self.wdt_deadline is not None:
+            ev.append((self.wdt_deadline, self._ev_wdt))
+        if self.host_resume is not None:
+            ev.append((self.host_resume[0], self._ev_host))
+        elif self.host_wait is not None:
+            ev.append((self.host_wait[1], self._ev_host_timeout))
+        for timer in self.timers:
+            t = timer.next_overflow()
+            if t is not None:
+                ev.append((t, timer.update))
+        return ev
+
+    def schedule(self):
+        ev = self._events()
+        self.next_event = math.ceil(min(t for t, _ in ev)) if ev else 1 << 62
+
+    def service(self):
+        while True:
+            ev = [(t, f) for t, f in self._events() if t <= self.cycles]
+            if not ev:
+                break
+            t, f = min(ev, key=lambda e: e[0])
+            f(t)
+        self.schedule()
+
+    def _ev_line(self, t):
+        _, _, byte = self.line.popleft()
+        self._receive(byte)
+
+    def _ev_tx(self, t):
+        self._host_receive(self.tx_shift_byte, t)
+        if self.tx_buffer is not None:
+            self.tx_shift_byte = self.tx_buffer
+            self.tx_buffer = None
+            self.tx_shift_until = t + self.device_byte_cycles()
+        else:
+            self.tx_shift_until = None
+            self.d[UCSR0A] |= 0x40
+
+    def _ev_spm(self, t):
+        self._finish_spm()
+
+    def _ev_eeprom(self, t):
+        self._finish_eeprom()
+
+    def _ev_wdt(self, t):
+        raise WatchdogReset()
+
+    def _ev_host(self, t):
+        n = self.host_resume[1]
+        self.host_time = t
+        self.host_resume = None
+        value = bytes(self.host_rx[:n])
+        del self.host_rx[:n]
+        self._host_run(value)
+
+    def _ev_host_timeout(self, t):
+        self.host_time = t
+        self.host_wait = None
+        self._host_run(None)
+
+    # --- CPU ------------------------------------------------------------
+
+    def run(self, host, limit_seconds=120.0):
+        self.host = host
+        self._host_run(None)
+        limit = limit_seconds * self.f_cpu
+        code = self.code
+        decode = self.decode
+        try:
+            while not self.done:
+                while self.cycles < self.next_event:
+                    f = code[self.pc]
+                    if f is None:
+                        f = code[self.pc] = decode(self.pc)
+                    f()
+                self.service()
+                if self.cycles > limit:
+                    raise SimError('no result after %g simulated seconds' % limit_seconds)
+        except WatchdogReset:
+            if not self.done:
+                raise SimError('watchdog reset at %.3f s' % (self.cycles / self.f_cpu))
+
+    def word(self, pc):
+        return self.flash[2 * pc] | self.flash[2 * pc + 1] << 8
+
+    def is_two_words(self, pc):
+        w = self.word(pc)
+        return (w & 0xFE0E) in (0x940C, 0x940E) or (w & 0xFC0F) in (0x9000, 0x9200)
+
+    def decode(self, pc):
+        if (pc << 1) < self.boot_start:
+            raise AppStarted()
+        if self.rww_busy and (pc << 1) < NRWW_START:
+            raise SimError('code run from the RWW section while it is busy')
+        w = self.word(pc)
+        f = self._fused_poll(pc, w)
+        return f or self._decode(pc, w)
+
+    def _fused_poll(self, pc, w):
+        """Handles "lds/in rN, REG; sbrs/sbrc rN, b; rjmp .-x" and
+        "sbis/sbic REG, b; rjmp .-4" polling loops on registers that only
+        change at events in one step, and skips them ahead to the next
+        event."""
+        c = self
+        d = self.d
+        w1 = self.word(pc + 1)
+        if (w & 0xFD00) == 0x9900:
+            # SBIC/SBIS
+            reg = 0x20 + ((w >> 3) & 0x1F)
+            if w1 != 0xCFFE or reg not in EVENT_REGISTERS:
+                return None
+            bit, exit_set = w & 7, bool(w & 0x0200)
+            exit_pc, period, exit_cycles = pc + 2, 3, 2
+            reg_dest = None
+        else:
+            if (w & 0xFE0F) == 0x9000:
+                reg = w1
+                rd = (w >> 4) & 0x1F
+                skip_pc, period_read = pc + 2, 2
+            elif (w & 0xF800) == 0xB000:
+                reg = 0x20 + ((w >> 5) & 0x30 | (w & 0x0F))
+                rd = (w >> 4) & 0x1F
+                skip_pc, period_read = pc + 1, 1
+            else:
+                return None
+            if reg not in EVENT_REGISTERS:
+                return None
+            ws = self.word(skip_pc)
+            wj = self.word(skip_pc + 1)
+            if (ws & 0xFC08) != 0xFC00 or (ws >> 4) & 0x1F != rd:
+                return None
+            if (wj & 0xF000) != 0xC000 or skip_pc + 2 + _signed(wj & 0xFFF, 12) != pc:
+                return None
+            bit, exit_set = ws & 7, bool(ws & 0x0200)
+            exit_pc, period, exit_cycles = skip_pc + 2, period_read + 3, period_read + 2
+            reg_dest = rd
+        read = self.read
+
+        def f():
+            v = read(reg)
+            if reg_dest is not None:
+                d[reg_dest] = v
+            if bool(v >> bit & 1) == exit_set:
+                c.pc = exit_pc
+                c.cycles += exit_cycles
+            else:
+                n = c.cycles + period
+                if n < c.next_event:
+                    n += (c.next_event - n) // period * period
+                c.cycles = n
+        return f
+
+    def _decode(self, pc, w):
+        c = self
+        d = self.d
+        read = self.read
+        write = self.write
+        npc = pc + 1
+        op = w >> 12
+
+        rd5 = (w >> 4) & 0x1F
+        rr5 = (w & 0x0F) | ((w >> 5) & 0x10)
+        rd4 = 16 + ((w >> 4) & 0x0F)
+        k8 = ((w >> 4) & 0xF0) | (w & 0x0F)
+
+        def skip_pc():
+            return npc + (2 if self.is_two_words(npc) else 1)
+
+        def alu(table, store, with_carry, keep_z, rd, get_b):
+            def f():
+                s = d[SREG]
+                v = table[(s & 1 if with_carry else 0) << 16 | d[rd] << 8 | get_b()]
+                flags = v >> 8
+                if keep_z and not s & 2:
+                    flags &= ~2
+                d[SREG] = (s & 0xC0) | flags
+                if store:
+                    d[rd] = v & 0xFF
+                c.pc = npc
+                c.cycles += 1
+            return f
+
+        if w == 0:
+            def f():
+                c.pc = npc
+                c.cycles += 1
+            return f
+
+        if op == 0:
+            sel = (w >> 10) & 3
+            if sel == 0:
+                sub = (w >> 8) & 3
+                if sub == 1:
+                    a, b = ((w >> 4) & 0xF) * 2, (w & 0xF) * 2
+
+                    def f():
+                        d[a] = d[b]
+                        d[a + 1] = d[b + 1]
+                        c.pc = npc
+                        c.cycles += 1
+                    return f
+                if sub == 2:
+                    return self._mul(npc, rd4, 16 + (w & 0xF), True, True, False)
+                if sub == 3:
+                    a, b = 16 + ((w >> 4) & 7), 16 + (w & 7)
+                    signed_d, signed_r, fractional = {
+                        0x00: (True, False, False),   # MULSU
+                        0x01: (False, False, True),   # FMUL
+                        0x10: (True, True, True),     # FMULS
+                        0x11: (True, False, True)}[(w >> 3) & 0x11]  # FMULSU
+                    return self._mul(npc, a, b, signed_d, signed_r, fractional)
+                raise SimError('unknown opcode 0x%04x at 0x%04x' % (w, pc << 1))
+            if sel == 1:
+                return alu(SUB_TABLE, False, True, True, rd5, lambda: d[rr5])
+            if sel == 2:
+                return alu(SUB_TABLE, True, True, True, rd5, lambda: d[rr5])
+            return alu(ADD_TABLE, True, False, False, rd5, lambda: d[rr5])
+
+        if op == 1:
+            sel = (w >> 10) & 3
+            if sel == 0:
+                target = skip_pc()
+
+                def f():
+                    c.cycles += 1
+                    if d[rd5] == d[rr5]:
+                        c.cycles += target - npc
+                        c.pc = target
+                    else:
+                        c.pc = npc
+                return f
+            if sel == 1:
+                return alu(SUB_TABLE, False, False, False, rd5, lambda: d[rr5])
+            if sel == 2:
+                return alu(SUB_TABLE, True, False, False, rd5, lambda: d[rr5])
+            return alu(ADD_TABLE, True, True, False, rd5, lambda: d[rr5])
+
+        if op == 2:
+            sel = (w >> 10) & 3
+            if sel == 3:
+                def f():
+                    d[rd5] = d[rr5]
+                    c.pc = npc
+                    c.cycles += 1
+                return f
+            fn = (lambda a, b: a & b, lambda a, b: a ^ b, lambda a, b: a | b)[sel]
+            return self._logic(npc, rd5, fn, lambda: d[rr5])
+
+        if op == 3:
+            return alu(SUB_TABLE, False, False, False, rd4, lambda: k8)
+        if op == 4:
+            return alu(SUB_TABLE, True, True, True, rd4, lambda: k8)
+        if op == 5:
+            return alu(SUB_TABLE, True, False, False, rd4, lambda: k8)
+        if op == 6:
+            return self._logic(npc, rd4, lambda a, b: a | b, lambda: k8)
+        if op == 7:
+            return self._logic(npc, rd4, lambda a, b: a & b, lambda: k8)
+        if op == 0xE:
+            def f():
+                d[rd4] = k8
+                c.pc = npc
+                c.cycles += 1
+            return f
+
+        if op in (8, 0xA):
+            # LDD/STD with displacement (LD/ST Y and Z when q is 0)
+            q = (w & 7) | ((w >> 7) & 0x18) | ((w >> 8) & 0x20)
+            ptr = 28 if w & 0x08 else 30
+            if w & 0x0200:
+                def f():
+                    write((d[ptr + 1] << 8 | d[ptr]) + q, d[rd5])
+                    c.pc = npc
+                    c.cycles += 2
+            else:
+                def f():
+                    d[rd5] = read((d[ptr + 1] << 8 | d[ptr]) + q)
+                    c.pc = npc
+                    c.cycles += 2
+            return f
+
+        if op == 0xB:
+            a = 0x20 + (((w >> 5) & 0x30) | (w & 0x0F))
+            if w & 0x0800:
+                def f():
+                    write(a, d[rd5])
+                    c.pc = npc
+                    c.cycles += 1
+            else:
+                def f():
+                    d[rd5] = read(a)
+                    c.pc = npc
+                    c.cycles += 1
+            return f
+
+        if op in (0xC, 0xD):
+            target = (pc + 1 + _signed(w & 0xFFF, 12)) & 0x3FFF
+            if op == 0xC:
+                def f():
+                    c.pc = target
+                    c.cycles += 2
+                return f
+
+            def f():
+                self.push_pc(npc)
+                c.pc = target
+                c.cycles += 3
+            return f
+
+        if op == 0xF:
+            sel = (w >> 9) & 7
+            bit = w & 7
+            if sel < 4:
+                target = (pc + 1 + _signed((w >> 3) & 0x7F, 7)) & 0x3FFF
+                want = 0 if sel >= 2 else 1
+                flag = 1 << bit
+
+                def f():
+                    if bool(d[SREG] & flag) == want:
+                        c.pc = target
+                        c.cycles += 2
+                    else:
+                        c.pc = npc
+                        c.cycles += 1
+                return f
+            if sel == 4:
+                def f():
+                    if d[SREG] & 0x40:
+                        d[rd5] |= 1 << bit
+                    else:
+                        d[rd5] &= ~(1 << bit) & 0xFF
+                    c.pc = npc
+                    c.cycles += 1
+                return f
+            if sel == 5:
+                def f():
+                    if d[rd5] >> bit & 1:
+                        d[SREG] |= 0x40
+                    else:
+                        d[SREG] &= 0xBF
+                    c.pc = npc
+                    c.cycles += 1
+                return f
+            target = skip_pc()
+            want = 1 if sel == 7 else 0
+
+            def f():
+                c.cycles += 1
+                if (d[rd5] >> bit & 1) == want:
+                    c.cycles += target - npc
+                    c.pc = target
+                else:
+                    c.pc = npc
+            return f
+
+        # op == 9
+        return self._decode9(pc, w, npc, rd5, rr5)
+
+    def _decode9(self, pc, w, npc, rd5, rr5):
+        c = self
+        d = self.d
+        read = self.read
+        write = self.write
+        sel = (w >> 8) & 0xF
+
+        if sel in (0, 1, 2, 3):
+            store = sel >= 2
+            mode = w & 0xF
+            if mode == 0:
+                a = self.word(pc + 1)
+                if store:
+                    def f():
+                        write(a, d[rd5])
+                        c.pc = npc + 1
+                        c.cycles += 2
+                else:
+                    def f():
+                        d[rd5] = read(a)
+                        c.pc = npc + 1
+                        c.cycles += 2
+                return f
+            if mode == 0xF:
+                if store:
+                    def f():
+                        sp = d[SPH] << 8 | d[SPL]
+                        d[sp] = d[rd5]
+                        sp -= 1
+                        d[SPL] = sp & 0xFF
+                        d[SPH] = sp >> 8
+                        c.pc = npc
+                        c.cycles += 2
+                else:
+                    def f():
+                        sp = (d[SPH] << 8 | d[SPL]) + 1
+                        d[rd5] = d[sp]
+                        d[SPL] = sp & 0xFF
+                        d[SPH] = sp >> 8
+                        c.pc = npc
+                        c.cycles += 2
+                return f
+            if not store and mode in (4, 5):
+                inc = mode == 5
+
+                def f():
+                    z = d[31] << 8 | d[30]
+                    d[rd5] = self.lpm(z)
+                    if inc:
+                        z = (z + 1) & 0xFFFF
+                        d[30] = z & 0xFF
+                        d[31] = z >> 8
+                    c.pc = npc
+                    c.cycles += 3
+                return f
+            ptrs = {1: (30, 1), 2: (30, -1), 9: (28, 1), 0xA: (28, -1),
+                    0xC: (26, 0), 0xD: (26, 1), 0xE: (26, -1)}
+            if mode not in ptrs:
+                raise SimError('unknown opcode 0x%04x at 0x%04x' % (w, pc << 1))
+            ptr, step = ptrs[mode]
+
+            def f():
+                a = d[ptr + 1] << 8 | d[ptr]
+                if step < 0:
+                    a = (a - 1) & 0xFFFF
+                if store:
+                    write(a, d[rd5])
+                else:
+                    d[rd5] = read(a)
+                if step > 0:
+                    a = (a + 1) & 0xFFFF
+                if step:
+                    d[ptr] = a & 0xFF
+                    d[ptr + 1] = a >> 8
+                c.pc = npc
+                c.cycles += 2
+            return f
+
+        if sel in (4, 5):
+            low = w & 0xF
+            if low == 0xE or low == 0xC:
+                # CALL/JMP
+                target = ((w >> 3) & 0x3E | (w & 1)) << 16 | self.word(pc + 1)
+                if low == 0xC:
+                    def f():
+                        c.pc = target
+                        c.cycles += 3
+                    return f
+
+                def f():
+                    self.push_pc(npc + 1)
+                    c.pc = target
+                    c.cycles += 4
+                return f
+            if low == 0x8:
+                if sel == 4:
+                    bit = (w >> 4) & 7
+                    if w & 0x80:
+                        def f():
+                            d[SREG] &= ~(1 << bit) & 0xFF
+                            c.pc = npc
+                            c.cycles += 1
+                    else:
+                        def f():
+                            d[SREG] |= 1 << bit
+                            c.pc = npc
+                            c.cycles += 1
+                    return f
+                which = (w >> 4) & 0xF
+                if which in (0, 1):
+                    reti = which == 1
+
+                    def f():
+                        c.pc = self.pop_pc()
+                        if reti:
+                            d[SREG] |= 0x80
+                        c.cycles += 4
+                    return f
+                if which in (8, 9):
+                    # SLEEP, BREAK
+                    def f():
+                        c.pc = npc
+                        c.cycles += 1
+                    return f
+                if which == 0xA:
+                    def f():
+                        self.wdr()
+                        c.pc = npc
+                        c.cycles += 1
+                    return f
+                if which == 0xC:
+                    def f():
+                        d[0] = self.lpm(d[31] << 8 | d[30])
+                        c.pc = npc
+                        c.cycles += 3
+                    return f
+                if which == 0xE:
+                    def f():
+                        c.pc = npc
+                        c.cycles += 1
+                        self.spm()
+                    return f
+                raise SimError('unknown opcode 0x%04x at 0x%04x' % (w, pc << 1))
+            if low == 0x9:
+                call = sel == 5
+
+                def f():
+                    if call:
+                        self.push_pc(npc)
+                    c.pc = d[31] << 8 | d[30]
+                    c.cycles += 3 if call else 2
+                return f
+            return self._decode_one_operand(pc, w, npc, rd5, low)
+
+        if sel in (6, 7):
+            rd = 24 + ((w >> 3) & 6)
+            k = ((w >> 2) & 0x30) | (w & 0xF)
+            add = sel == 6
+
+            def f():
+                a = d[rd + 1] << 8 | d[rd]
+                r = a + k if add else a - k
+                r &= 0xFFFF
+                s = d[SREG] & 0xE0
+                if add:
+                    v = (r >> 15) & ~(a >> 15) & 1
+                    cf = ~(r >> 15) & (a >> 15) & 1
+                else:
+                    v = (a >> 15) & ~(r >> 15) & 1
+                    cf = (r >> 15) & ~(a >> 15) & 1
+                n = r >> 15
+                d[SREG] = s | (n ^ v) << 4 | v << 3 | n << 2 | (r == 0) << 1 | cf
+                d[rd] = r & 0xFF
+                d[rd + 1] = r >> 8
+                c.pc = npc
+                c.cycles += 2
+            return f
+
+        if sel in (8, 9, 0xA, 0xB):
+            a = 0x20 + ((w >> 3) & 0x1F)
+            bit = w & 7
+            if sel in (8, 0xA):
+                set_bit = sel == 0xA
+                single = a in SINGLE_BIT_REGISTERS
+
+                def f():
+                    if single:
+                        if set_bit:
+                            write(a, 1 << bit)
+                    elif set_bit:
+                        write(a, read(a) | 1 << bit)
+                    else:
+                        write(a, read(a) & ~(1 << bit) & 0xFF)
+                    c.pc = npc
+                    c.cycles += 2
+                return f
+            want = 1 if sel == 0xB else 0
+            target = npc + (2 if self.is_two_words(npc) else 1)
+
+            def f():
+                c.cycles += 1
+                if (read(a) >> bit & 1) == want:
+                    c.cycles += target - npc
+                    c.pc = target
+                else:
+                    c.pc = npc
+            return f
+
+        # MUL
+        return self._mul(npc, rd5, rr5, False, False, False)
+
+    def _decode_one_operand(self, pc, w, npc, rd, low):
+        c = self
+        d = self.d
+
+        if low == 0x0:
+            def f():
+                r = ~d[rd] & 0xFF
+                d[rd] = r
+                d[SREG] = (d[SREG] & 0xE0) | LOGIC_TABLE[r] | 1
+                c.pc = npc
+                c.cycles += 1
+            return f
+        if low == 0x1:
+            def f():
+                v = SUB_TABLE[d[rd]]
+                d[rd] = v & 0xFF
+                d[SREG] = (d[SREG] & 0xC0) | (v >> 8)
+                c.pc = npc
+                c.cycles += 1
+            return f
+        if low == 0x2:
+            def f():
+                r = d[rd]
+                d[rd] = ((r << 4) | (r >> 4)) & 0xFF
+                c.pc = npc
+                c.cycles += 1
+            return f
+        if low in (0x3, 0xA):
+            inc = low == 0x3
+
+            def f():
+                r = (d[rd] + (1 if inc else -1)) & 0xFF
+                d[rd] = r
+                v = 1 if r == (0x80 if inc else 0x7F) else 0
+                n = r >> 7
+                d[SREG] = (d[SREG] & 0xE1) | (n ^ v) << 4 | v << 3 | n << 2 | (r == 0) << 1
+                c.pc = npc
+                c.cycles += 1
+            return f
+        if low in (0x5, 0x6, 0x7):
+            def f():
+                a = d[rd]
+                s = d[SREG]
+                if low == 0x5:
+                    r = (a >> 1) | (a & 0x80)
+                elif low == 0x6:
+                    r = a >> 1
+                else:
+                    r = (a >> 1) | (s & 1) << 7
+                cf = a & 1
+                n = r >> 7
+                v = n ^ cf
+                d[rd] = r
+                d[SREG] = (s & 0xE0) | (n ^ v) << 4 | v << 3 | n << 2 | (r == 0) << 1 | cf
+                c.pc = npc
+                c.cycles += 1
+            return f
+        raise SimError('unknown opcode 0x%04x at 0x%04x' % (w, pc << 1))
+
+    def _logic(self, npc, rd, fn, get_b):
+        c = self
+        d = self.d
+
+        def f():
+            r = fn(d[rd], get_b())
+            d[rd] = r
+            d[SREG] = (d[SREG] & 0xE1) | LOGIC_TABLE[r]
+            c.pc = npc
+            c.cycles += 1
+        return f
+
+    def _mul(self, npc, rd, rr, signed_d, signed_r, fractional):
+        c = self
+        d = self.d
+
+        def f():
+            a = d[rd]
+            b = d[rr]
+            if signed_d and a & 0x80:
+                a -= 0x100
+            if signed_r and b & 0x80:
+                b -= 0x100
+            r = (a * b) & 0xFFFF
+            cf = r >> 15
+            if fractional:
+                r = (r << 1) & 0xFFFF
+            d[0] = r & 0xFF
+            d[1] = r >> 8
+            d[SREG] = (d[SREG] & 0xFC) | (r == 0) << 1 | cf
+            c.pc = npc
+            c.cycles += 2
+        return f
+
+    def push_pc(self, value):
+        d = self.d
+        sp = d[SPH] << 8 | d[SPL]
+        d[sp] = value & 0xFF
+        d[sp - 1] = value >> 8
+        sp -= 2
+        d[SPL] = sp & 0xFF
+        d[SPH] = sp >> 8
+
+    def pop_pc(self):
+        d = self.d
+        sp = d[SPH] << 8 | d[SPL]
+        value = d[sp + 1] << 8 | d[sp + 2]
+        sp += 2
+        d[SPL] = sp & 0xFF
+        d[SPH] = sp >> 8
+        return value
+
+
+class WatchdogReset(Exception):
+    pass
+
+
+class AppStarted(Exception):
+    pass
+
+
+def _signed(value, bits):
+    return value - (1 << bits) if value & (1 << (bits - 1)) else value
+
+
+def command(data, reply_length, timeout=1.0):
+    """Sends an STK500 command and returns its reply, less STK_INSYNC and
+    STK_OK."""
+    yield ('send', bytes(data) + bytes([CRC_EOP]))
+    reply = yield ('recv', reply_length + 2, timeout)
+    if reply is None:
+        raise SimError('no reply to command 0x%02x' % data[0])
+    if reply[0] != STK_INSYNC or reply[-1] != STK_OK:
+        raise SimError('bad reply to command 0x%02x: %s' % (data[0], reply.hex()))
+    return reply[1:-1]
+
+
+def connect():
+    """Syncs and enters programming mode the way avrdude does."""
+    # Without AUTOBAUD the first sync is answered once the LED has flashed.
+    # With it, the bootloader times the second and answers the third.
+    for attempt in range(10):
+        yield ('drain',)
+        yield ('send', bytes([0x30, CRC_EOP]))
+        reply = yield ('recv', 2, 0.5)
+        if reply == bytes([STK_INSYNC, STK_OK]):
+            break
+    else:
+        raise SimError('no sync')
+    yield ('mark', 'sync')
+
+    yield from command([0x41, 0x81], 1)
+    yield from command([0x41, 0x82], 1)
+    yield from command([0x42] + [0] * 20, 0)
+    yield from command([0x45, 5, 4, 0xD7, 0xC2, 0], 0)
+    yield from command([0x50], 0)
+    yield from command([0x75], 3)
+
+
+def verify_and_leave(image, size, verify):
+    """Reads the image back page by page, and leaves programming mode."""
+    yield ('mark', 'verify')
+    if verify:
+        for addr in range(0, size, PAGE_SIZE):
+            page = image[addr:addr + PAGE_SIZE]
+            if page == b'\xff' * PAGE_SIZE:
+                continue
+            yield from command([0x55, (addr >> 1) & 0xFF, addr >> 9], 0)
+            data = yield from command([0x74, 0, PAGE_SIZE, 0x46], PAGE_SIZE)
+            if data != page:
+                raise SimError('verify failed at 0x%04x' % addr)
+
+    yield from command([0x51], 0)
+    yield ('mark', 'done')
+
+
+def avrdude(image, size, verify=True):
+    """What "avrdude -c arduino -U flash:w:..." sends, as a coroutine for
+    Simulator.run()."""
+    yield from connect()
+
+    yield ('mark', 'write')
+    for addr in range(0, size, PAGE_SIZE):
+        page = image[addr:addr + PAGE_SIZE]
+        if page == b'\xff' * PAGE_SIZE:
+            continue
+        yield from command([0x55, (addr >> 1) & 0xFF, addr >> 9], 0)
+        yield from command([0x64, 0, PAGE_SIZE, 0x46] + list(page), 0)
+
+    yield from verify_and_leave(image, size, verify)
+
+
+def stream_upload(image, size, verify=True):
+    """Like avrdude(), but writes each run of pages below the NRWW section
+    with one STREAM_PAGES 'y' command.  The host sends two pages, then one
+    more for each STK_INSYNC, so it never has more than the bootloader's
+    two page buffers in flight.  Pages in the NRWW section are written
+    with PROG_PAGE as usual."""
+    yield from connect()
+
+    yield ('mark', 'write')
+    addr = 0
+    while addr < size:
+        page = image[addr:addr + PAGE_SIZE]
+        if page == b'\xff' * PAGE_SIZE:
+            addr += PAGE_SIZE
+            continue
+        yield from command([0x55, (addr >> 1) & 0xFF, addr >> 9], 0)
+        if addr >= NRWW_START:
+            yield from command([0x64, 0, PAGE_SIZE, 0x46] + list(page), 0)
+            addr += PAGE_SIZE
+            continue
+
+        run = []
+        while (addr < size and addr < NRWW_START and len(run) < 255 and
+               image[addr:addr + PAGE_SIZE] != b'\xff' * PAGE_SIZE):
+            run.append(bytes(image[addr:addr + PAGE_SIZE]))
+            addr += PAGE_SIZE
+        yield ('send', bytes([STK_PROG_STREAM, len(run), CRC_EOP]))
+        reply = yield ('recv', 1, 1.0)
+        if reply != bytes([STK_INSYNC]):
+            raise SimError('bad reply to stream of %d pages: %s'
+                           % (len(run), reply.hex() if reply else 'none'))
+        sent = min(2, len(run))
+        yield ('send', b''.join(run[:sent]))
+        for i in range(len(run)):
+            reply = yield ('recv', 1, 1.0)
+            if reply != bytes([STK_INSYNC]):
+                raise SimError('stream stalled after %d of %d pages' % (i, len(run)))
+            if sent < len(run):
+                yield ('send', run[sent])
+                sent += 1
+        reply = yield ('recv', 1, 1.0)
+        if reply != bytes([STK_OK]):
+            raise SimError('no STK_OK after stream of %d pages' % len(run))
+
+    yield from verify_and_leave(image, size, verify)
+
+
+def simulate(bootloader, f_cpu, baud, image, size, latency, verify, stream=False):
+    sim = Simulator(bootloader, f_cpu, baud, latency)
+    if size is None:
+        size = sim.boot_start
+    sim.run((stream_upload if stream else avrdude)(image, size, verify))
+    for addr in range(0, size, PAGE_SIZE):
+        page = image[addr:addr + PAGE_SIZE]
+        if page != b'\xff' * PAGE_SIZE and sim.flash[addr:addr + PAGE_SIZE] != page:
+            sim.error('flash differs from the image at 0x%04x' % addr)
+    return sim
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Simulated avrdude uploads to Optiboot builds.')
+    parser.add_argument('builds', nargs='+', metavar='HEX F_CPU BAUD',
+                        help='bootloader .hex, clock and baud rate, repeated')
+    parser.add_argument('--image', help='sketch .hex to upload (default: random data)')
+    parser.add_argument('--size', type=lambda s: int(s, 0),
+                        help='bytes of random data (default: the application section)')
+    parser.add_argument('--latency', type=float, default=0.0,
+                        help='host turnaround in seconds after each reply')
+    parser.add_argument('--no-verify', action='store_true', help='skip the read-back')
+    parser.add_argument('--stream', action='store_true',
+                        help="write with STREAM_PAGES 'y' commands (see stream_upload())")
+    parser.add_argument('--seed', type=int, default=1)
+    args = parser.parse_args()
+
+    if len(args.builds) % 3:
+        parser.error('builds are given as HEX F_CPU BAUD')
+
+    print('%-36s %8s %8s %12s %12s %9s  %s' % (
+        'build', 'sent', 'received', 'SPM wait', 'cycles', 'seconds', 'result'))
+    failed = False
+    for i in range(0, len(args.builds), 3):
+        path = args.builds[i]
+        f_cpu = int(args.builds[i + 1].rstrip('L'))
+        baud = int(args.builds[i + 2])
+
+        if args.image:
+            image, _, high = read_hex(args.image)
+            size = args.size or high
+        else:
+            rng = random.Random(args.seed)
+            image = bytearray(rng.getrandbits(8) for _ in range(FLASH_SIZE))
+            size = args.size
+
+        try:
+            sim = simulate(path, f_cpu, baud, image, size, args.latency,
+                           not args.no_verify, args.stream)
+        except (SimError, AppStarted, OSError) as e:
+            print('%-36s %s' % (path, e or 'application started'))
+            failed = True
+            continue
+
+        cycles = int(sim.marks['done'] - sim.marks['sync'])
+        problems = list(sim.errors)
+        if sim.overruns:
+            problems.append('%d receive overruns' % sim.overruns)
+        if sim.framing_errors:
+            problems.append('%d framing errors' % sim.framing_errors)
+        print('%-36s %8d %8d %12d %12d %9.3f  %s' % (
+            path, sim.bytes_sent, sim.bytes_received, sim.spm_wait_cycles,
+            cycles, cycles / f_cpu, 'ok' if not problems else problems[0]))
+        for p in problems[1:]:
+            print('%-36s %s' % ('', p))
+        failed = failed or bool(problems)
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
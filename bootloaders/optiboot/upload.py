@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+"""Uploads a sketch to an Optiboot board over a serial port, and times it.
+
+This runs the host side of simulate.py (avrdude() or, with --stream,
+stream_upload()) on a real serial port, so an upload to a board can be
+timed the same way as a simulated one and the two compared.  It resets
+the board through DTR and RTS the way avrdude's "arduino" programmer does,
+writes and verifies the image, and reports the time of each part of the
+upload along with the number of replies waited for and the mean time from
+the last byte sent to a reply.  simulate.py on the same build gives the
+times without a USB serial adapter in the way.
+
+    python3 upload.py /dev/ttyACM0 Blink.ino.hex --baud 115200 --stream
+
+Needs pyserial.
+"""
+
+import argparse
+import sys
+import time
+
+import serial
+
+from simulate import SimError, avrdude, read_hex, stream_upload
+
+
+class Port(object):
+    """Runs a simulate.py host coroutine on a serial port."""
+
+    def __init__(self, device, baud):
+        self.serial = serial.Serial(device, baud, timeout=0)
+        self.rx = bytearray()
+        self.marks = {}
+        self.replies = 0
+        self.reply_time = 0.0
+        self.last_send = None
+
+    def reset(self):
+        self.serial.dtr = self.serial.rts = False
+        time.sleep(0.25)
+        self.serial.dtr = self.serial.rts = True
+        time.sleep(0.05)
+
+    def _recv(self, n, timeout):
+        deadline = time.monotonic() + timeout
+        while len(self.rx) < n:
+            left = deadline - time.monotonic()
+            if left <= 0:
+                return None
+            self.serial.timeout = left
+            self.rx += self.serial.read(n - len(self.rx))
+        if self.last_send is not None:
+            self.replies += 1
+            self.reply_time += time.monotonic() - self.last_send
+            self.last_send = None
+        value = bytes(self.rx[:n])
+        del self.rx[:n]
+        return value
+
+    def run(self, host):
+        value = None
+        while True:
+            try:
+                action = host.send(value)
+            except StopIteration:
+                return
+            value = None
+            kind = action[0]
+            if kind == 'send':
+                self.serial.write(action[1])
+                self.serial.flush()
+                self.last_send = time.monotonic()
+            elif kind == 'drain':
+                self.serial.reset_input_buffer()
+                del self.rx[:]
+            elif kind == 'mark':
+                self.marks[action[1]] = time.monotonic()
+            elif kind == 'recv':
+                value = self._recv(action[1], action[2])
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Timed upload to an Optiboot board.')
+    parser.add_argument('port', help='serial port, e.g. /dev/ttyACM0 or COM3')
+    parser.add_argument('image', help='sketch .hex to upload')
+    parser.add_argument('--baud', type=int, default=115200)
+    parser.add_argument('--stream', action='store_true',
+                        help="write with STREAM_PAGES 'y' commands")
+    parser.add_argument('--no-verify', action='store_true', help='skip the read-back')
+    parser.add_argument('--no-reset', action='store_true',
+                        help="don't reset the board through DTR and RTS first")
+    args = parser.parse_args()
+
+    image, _, high = read_hex(args.image)
+    port = Port(args.port, args.baud)
+    if not args.no_reset:
+        port.reset()
+    host = (stream_upload if args.stream else avrdude)(image, high, not args.no_verify)
+    try:
+        port.run(host)
+    except SimError as e:
+        print('%s: %s' % (args.port, e))
+        return 1
+
+    m = port.marks
+    print('connect %.3f s, write %.3f s, verify %.3f s, total %.3f s' % (
+        m['write'] - m['sync'], m['verify'] - m['write'], m['done'] - m['verify'],
+        m['done'] - m['sync']))
+    if port.replies:
+        print('%d replies, %.2f ms from the last byte sent to a reply on average'
+              % (port.replies, 1000 * port.reply_time / port.replies))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
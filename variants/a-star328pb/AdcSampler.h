@@ -0,0 +1,220 @@
+/* AdcSampler.h - Samples the A-Star 328PB's analog inputs in the background.
+ *
+ * analogRead() waits about 110 us for each conversion.  AdcSampler has
+ * Timer1 start the conversions at a fixed rate, scanning a list of the analog
+ * inputs A0 to A7, and an interrupt stores the results in a ring buffer that
+ * the sketch reads whenever it likes.  Optionally, each stored sample is the
+ * average of several conversions of its channel, which lowers the noise and
+ * the rate the sketch has to keep up with.
+ *
+ * The interrupt is the only writer of the buffer and the sketch the only
+ * reader, and each side only changes its own 8-bit index, so neither needs to
+ * disable interrupts.  If the sketch falls behind, new samples are dropped
+ * and counted in overruns().
+ *
+ * The sketch has to provide the interrupt handler, with ADC_SAMPLER_ISR, so
+ * that sketches that don't use AdcSampler keep the ADC interrupt free:
+ *
+ *   typedef AdcSampler<64> Sampler;
+ *   ADC_SAMPLER_ISR(Sampler)
+ *
+ *   const uint8_t channels[] = { A0, A1, A6 };
+ *
+ *   void setup()
+ *   {
+ *     Serial.begin(115200);
+ *     Sampler::start(channels, 3, 6000, 4);  // 500 samples/s per channel
+ *   }
+ *
+ *   void loop()
+ *   {
+ *     uint8_t channel;
+ *     uint16_t value;
+ *     while (Sampler::read(channel, value)) { ... }
+ *   }
+ *
+ * Timer1 can't be used for PWM on pins 9 and 10 (or by the Servo library)
+ * while the sampler runs.  With the ADC clocked at F_CPU/128, as the Arduino
+ * core sets it up, a conversion takes 13 ADC clocks, which limits the
+ * conversion rate to about 9 kHz at 16 MHz; triggers that come while a
+ * conversion is still running are skipped.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+/// Defines the ADC interrupt handler for the given AdcSampler type.  Use it
+/// once, in one source file of the sketch.
+#define ADC_SAMPLER_ISR(sampler) ISR(ADC_vect) { sampler::handleInterrupt(); }
+
+/// bufferSize is the number of samples the ring buffer can hold plus one; it
+/// must be a power of two from 2 to 128.
+template <uint8_t bufferSize = 64> class AdcSampler
+{
+  static_assert(bufferSize >= 2 && bufferSize <= 128 &&
+    (bufferSize & (bufferSize - 1)) == 0,
+    "AdcSampler: bufferSize must be a power of two from 2 to 128");
+
+public:
+  /// Starts sampling.  channels holds count analog inputs (A0 to A7, or 0 to
+  /// 7), which are converted in turn, conversionRate times per second in
+  /// total (at least 31 at 16 MHz).  Each stored sample is the average of
+  /// average (1, 2, 4, 8, 16, 32 or 64) conversions of its channel.
+  /// reference is as for analogReference().
+  static void start(const uint8_t * channels, uint8_t count,
+    uint16_t conversionRate, uint8_t average = 1, uint8_t reference = 1)
+  {
+    stop();
+
+    if (count > 8) { count = 8; }
+    for (uint8_t i = 0; i < count; i++)
+    {
+      uint8_t channel = channels[i];
+      if (channel >= 14) { channel -= 14; }
+      admux[i] = (reference << 6) | (channel & 7);
+      sums[i] = 0;
+    }
+    channelCount = count;
+    channelIndex = 0;
+
+    averageShift = 0;
+    while ((1 << averageShift) < average && averageShift < 6) { averageShift++; }
+    averageMask = (1 << averageShift) - 1;
+    scanCount = 0;
+
+    head = tail = 0;
+    overrunCount = 0;
+
+    uint16_t top = F_CPU / 8 / conversionRate - 1;
+
+    uint8_t sreg = SREG;
+    cli();
+    ADMUX = admux[0];
+
+    // Timer1 in CTC mode (mode 4, TOP = OCR1A) at F_CPU/8.  The ADC is
+    // started by the compare match B flag, so OCR1B matches at TOP too.
+    TCCR1B = 0;
+    TCCR1A = 0;
+    TCNT1 = 0;
+    OCR1A = top;
+    OCR1B = top;
+    TIFR1 = _BV(OCF1B);
+    TCCR1B = _BV(WGM12) | _BV(CS11);
+
+    // Auto trigger from Timer1 compare match B, F_CPU/128
+    ADCSRB = _BV(ADTS2) | _BV(ADTS0);
+    ADCSRA = _BV(ADEN) | _BV(ADATE) | _BV(ADIF) | _BV(ADIE) |
+      _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+    SREG = sreg;
+  }
+
+  /// Stops sampling, and puts the ADC and Timer1 back the way the Arduino
+  /// core sets them up.  Samples already in the buffer can still be read.
+  static void stop()
+  {
+    uint8_t sreg = SREG;
+    cli();
+    ADCSRA = _BV(ADEN) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+    ADCSRB = 0;
+    TCCR1B = _BV(CS11) | _BV(CS10);
+    TCCR1A = _BV(WGM10);
+    SREG = sreg;
+  }
+
+  /// Gets the oldest sample in the buffer.  channel is its index in the
+  /// channel list given to start().  Returns false if there are none.
+  static bool read(uint8_t & channel, uint16_t & value)
+  {
+    uint8_t t = tail;
+    if (t == head) { return false; }
+    uint16_t sample = buffer[t];
+    tail = (t + 1) & (bufferSize - 1);
+    channel = sample >> 12;
+    value = sample & 0x3FF;
+    return true;
+  }
+
+  /// Returns the number of samples in the buffer.
+  static uint8_t available()
+  {
+    return (head - tail) & (bufferSize - 1);
+  }
+
+  /// Returns the number of samples dropped because the buffer was full.
+  static uint16_t overruns()
+  {
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t count = overrunCount;
+    SREG = sreg;
+    return count;
+  }
+
+  /// Stores the result of the conversion that just finished and selects the
+  /// next channel.  Called from the interrupt defined by ADC_SAMPLER_ISR.
+  static inline void handleInterrupt() __attribute__((always_inline))
+  {
+    uint16_t value = ADC;
+
+    // The trigger is the rising edge of the flag, so clear it for the next.
+    TIFR1 = _BV(OCF1B);
+
+    uint8_t i = channelIndex;
+    uint8_t next = i + 1;
+    if (next == channelCount) { next = 0; }
+
+    // The next conversion starts at the next trigger, a full period away.
+    ADMUX = admux[next];
+    channelIndex = next;
+
+    uint16_t sum = sums[i] + value;
+    if (scanCount == averageMask)
+    {
+      uint8_t h = head;
+      uint8_t newHead = (h + 1) & (bufferSize - 1);
+      if (newHead == tail)
+      {
+        overrunCount++;
+      }
+      else
+      {
+        buffer[h] = ((uint16_t)i << 12) | (sum >> averageShift);
+        head = newHead;
+      }
+      sum = 0;
+    }
+    sums[i] = sum;
+
+    if (next == 0) { scanCount = (scanCount + 1) & averageMask; }
+  }
+
+private:
+  // Samples, with the channel index in bits 12 to 14
+  static volatile uint16_t buffer[bufferSize];
+  static volatile uint8_t head;   // written by the interrupt only
+  static volatile uint8_t tail;   // written by read() only
+  static volatile uint16_t overrunCount;
+
+  static uint8_t admux[8];
+  static uint16_t sums[8];
+  static uint8_t channelCount;
+  static uint8_t channelIndex;
+  static uint8_t averageShift;
+  static uint8_t averageMask;
+  static uint8_t scanCount;
+};
+
+template <uint8_t n> volatile uint16_t AdcSampler<n>::buffer[n];
+template <uint8_t n> volatile uint8_t AdcSampler<n>::head;
+template <uint8_t n> volatile uint8_t AdcSampler<n>::tail;
+template <uint8_t n> volatile uint16_t AdcSampler<n>::overrunCount;
+template <uint8_t n> uint8_t AdcSampler<n>::admux[8];
+template <uint8_t n> uint16_t AdcSampler<n>::sums[8];
+template <uint8_t n> uint8_t AdcSampler<n>::channelCount;
+template <uint8_t n> uint8_t AdcSampler<n>::channelIndex;
+template <uint8_t n> uint8_t AdcSampler<n>::averageShift;
+template <uint8_t n> uint8_t AdcSampler<n>::averageMask;
+template <uint8_t n> uint8_t AdcSampler<n>::scanCount;
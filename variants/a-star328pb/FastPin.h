@@ -0,0 +1,138 @@
+/* FastPin.h - Digital I/O on A-Star 328PB pins in single instructions.
+ *
+ * digitalWrite() and digitalRead() look the pin up in the PROGMEM tables in
+ * pins_arduino.h and check whether it has PWM running every time they are
+ * called, which takes about 50 cycles.  FastPin takes the pin number as a
+ * template argument, so the port and bit are worked out by the compiler and
+ * each call becomes one I/O instruction:
+ *
+ *   high(), low(), toggle(), setOutput(), setInput()   2 cycles (sbi/cbi)
+ *   read()                                             1 cycle (in), plus
+ *                                                      the bit test
+ *
+ * high(), low() and toggle() are single sbi/cbi instructions, so they are safe
+ * to use on pins of a port that an interrupt also writes to.  Unlike
+ * digitalWrite(), they do not turn off PWM on the pin.
+ *
+ * All 24 pins are supported, including the 328PB's port E pins 20 to 23.
+ *
+ * Example:
+ *
+ *   FastPin<13>::setOutput();
+ *   FastPin<13>::high();
+ *   if (FastPin<4>::read()) { FastPin<13>::toggle(); }
+ *
+ * To count the cycles a call takes, run Timer1 from the CPU clock and
+ * compare against an empty measurement:
+ *
+ *   TCCR1A = 0;
+ *   TCCR1B = 1;    // clk/1
+ *   cli();
+ *   uint16_t t0 = TCNT1;
+ *   uint16_t t1 = TCNT1;
+ *   FastPin<13>::toggle();
+ *   uint16_t t2 = TCNT1;
+ *   sei();
+ *   Serial.println((t2 - t1) - (t1 - t0));   // 2
+ *
+ * The same measurement around digitalWrite(13, HIGH) gives the cost of the
+ * table lookups.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <avr/io.h>
+
+template <uint8_t pin> class FastPin
+{
+  static_assert(pin < 24, "FastPin: the A-Star 328PB has pins 0 to 23");
+
+public:
+  /// Bit number of the pin in its port, as in digital_pin_to_bit_mask_PGM.
+  static const uint8_t bit =
+    pin < 8 ? pin :                // PD0-PD7
+    pin < 14 ? pin - 8 :           // PB0-PB5
+    pin < 20 ? pin - 14 :          // PC0-PC5
+    pin < 22 ? pin - 18 :          // PE2, PE3 (A6, A7)
+    pin - 22;                      // PE0, PE1
+
+  /// I/O space addresses (as used by in, out, sbi and cbi) of the PINx, DDRx
+  /// and PORTx registers of the pin's port.  Each port's registers are in
+  /// that order, starting at 0x03 for port B.
+  static const uint8_t pinAddress =
+    pin < 8 ? 0x09 :               // PIND
+    pin < 14 ? 0x03 :              // PINB
+    pin < 20 ? 0x06 :              // PINC
+    0x0C;                          // PINE
+  static const uint8_t ddrAddress = pinAddress + 1;
+  static const uint8_t portAddress = pinAddress + 2;
+
+  /// Drives the pin high if it is an output, or enables its pull-up if it
+  /// is an input.
+  static inline void high() __attribute__((always_inline))
+  {
+    asm volatile("sbi %0, %1" : : "I" (portAddress), "I" (bit));
+  }
+
+  /// Drives the pin low if it is an output, or disables its pull-up if it
+  /// is an input.
+  static inline void low() __attribute__((always_inline))
+  {
+    asm volatile("cbi %0, %1" : : "I" (portAddress), "I" (bit));
+  }
+
+  /// Sets the pin high or low.  A constant value compiles to a single
+  /// instruction.
+  static inline void write(bool value) __attribute__((always_inline))
+  {
+    if (value) { high(); } else { low(); }
+  }
+
+  /// Toggles the pin's PORTx bit, by writing a 1 to its PINx bit.
+  static inline void toggle() __attribute__((always_inline))
+  {
+    asm volatile("sbi %0, %1" : : "I" (pinAddress), "I" (bit));
+  }
+
+  /// Returns the level on the pin.
+  static inline bool read() __attribute__((always_inline))
+  {
+    return _SFR_IO8(pinAddress) & (1 << bit);
+  }
+
+  /// Makes the pin an output.  It drives the level last given to high(),
+  /// low() or write().
+  static inline void setOutput() __attribute__((always_inline))
+  {
+    asm volatile("sbi %0, %1" : : "I" (ddrAddress), "I" (bit));
+  }
+
+  /// Makes the pin an input.  Its pull-up is enabled if the pin was last
+  /// set high.
+  static inline void setInput() __attribute__((always_inline))
+  {
+    asm volatile("cbi %0, %1" : : "I" (ddrAddress), "I" (bit));
+  }
+
+  /// Same as pinMode(pin, OUTPUT) followed by digitalWrite(pin, value).
+  static inline void setOutput(bool value) __attribute__((always_inline))
+  {
+    write(value);
+    setOutput();
+  }
+
+  /// Same as pinMode(pin, INPUT).
+  static inline void setInputFloating() __attribute__((always_inline))
+  {
+    setInput();
+    low();
+  }
+
+  /// Same as pinMode(pin, INPUT_PULLUP).
+  static inline void setInputPulledUp() __attribute__((always_inline))
+  {
+    setInput();
+    high();
+  }
+};
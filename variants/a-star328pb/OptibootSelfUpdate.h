@@ -0,0 +1,80 @@
+/* OptibootSelfUpdate.h - Lets a sketch write flash through the A-Star 328PB
+ * bootloader.
+ *
+ * The AVR only runs SPM instructions from the boot section, so a sketch that
+ * receives a new image over a radio or I2C link cannot store it by itself.
+ * Optiboot builds with SPM_API (the 1 KB "big" and "ab" builds in
+ * bootloaders/optiboot/Makefile) have a jump to their do_spm() function at
+ * byte address 0x7FFC, just below the version word, and these functions call
+ * it.  The 512-byte bootloader that is installed by default does not have it.
+ *
+ * Each call waits for the previous flash or EEPROM write to finish.  Interrupts
+ * are disabled while a page is being erased or written (about 4 ms each).
+ *
+ * Example:
+ *
+ *   uint8_t page[OptibootSelfUpdate::pageSize];
+ *   // ... receive the page ...
+ *   OptibootSelfUpdate::writePage(0x4000, page);
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <avr/io.h>
+
+class OptibootSelfUpdate
+{
+public:
+  /// Size of a flash page in bytes.  Page addresses must be multiples of this.
+  static const uint16_t pageSize = SPM_PAGESIZE;
+
+  /// Byte address of the jump to do_spm() in the bootloader.
+  static const uint16_t entryAddress = 0x7FFC;
+
+  /// SPMCSR values for each operation, as in the bootloader's boot.h.
+  static const uint8_t fillCommand = 0x01;
+  static const uint8_t eraseCommand = 0x03;
+  static const uint8_t writeCommand = 0x05;
+
+  /// Erases the page at the given byte address.
+  static void erasePage(uint16_t address)
+  {
+    doSpm(address, eraseCommand, 0);
+  }
+
+  /// Loads one word into the bootloader's page buffer, at the given byte
+  /// address within the page.
+  static void fillWord(uint16_t address, uint16_t data)
+  {
+    doSpm(address, fillCommand, data);
+  }
+
+  /// Writes the page buffer to the page at the given byte address, which must
+  /// have been erased.
+  static void writePage(uint16_t address)
+  {
+    doSpm(address, writeCommand, 0);
+  }
+
+  /// Erases the page at the given byte address and writes pageSize bytes of
+  /// data from RAM to it.
+  static void writePage(uint16_t address, const uint8_t * data)
+  {
+    for (uint16_t i = 0; i < pageSize; i += 2)
+    {
+      fillWord(address + i, data[i] | (data[i + 1] << 8));
+    }
+    // The page buffer is kept through the erase.
+    erasePage(address);
+    writePage(address);
+  }
+
+private:
+  static void doSpm(uint16_t address, uint8_t command, uint16_t data)
+  {
+    // Function pointers hold word addresses.
+    typedef void (*DoSpm)(uint16_t, uint8_t, uint16_t);
+    ((DoSpm)(entryAddress / 2))(address, command, data);
+  }
+};
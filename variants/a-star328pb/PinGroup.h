@@ -0,0 +1,225 @@
+/* PinGroup.h - Reads and writes groups of A-Star 328PB pins at once.
+ *
+ * Setting an 8-bit bus with digitalWrite() takes eight table lookups and
+ * eight read-modify-writes of the port, over 400 cycles.  This header has two
+ * ways to do it with one access per port:
+ *
+ * The port functions take a port (PB, PC, PD or PE, as returned by
+ * digitalPinToPort()) and a bit mask, and look the port registers up in
+ * port_to_output_PGM, port_to_input_PGM and port_to_mode_PGM, like the core's
+ * pin functions.  They can be used from C.
+ *
+ *   portSetOutput(PD, 0xFF);
+ *   portWrite(PD, 0xFF, data);    // pins 0-7
+ *
+ * PinGroup<pins...> (C++ only) is a bus made of any of the 24 pins, with the
+ * first pin as bit 0 of the value.  Everything about the pins is worked out at
+ * compile time.  Each port the bus uses is read or written once; a port
+ * holding bus bits in order (such as pins 8-11 as bits 4-7) costs a shift and
+ * a mask, other pins a bit test each.  The example below is 8 bits split over
+ * ports B and D, and write() takes under 20 cycles:
+ *
+ *   typedef PinGroup<4, 5, 6, 7, 8, 9, 10, 11> Bus;
+ *   Bus::setOutput();
+ *   Bus::write(0xA5);
+ *
+ * Writes to ports that the bus only partly uses are done with interrupts
+ * disabled, so interrupts can safely change the other pins of those ports.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <util/atomic.h>
+
+/// Sets the pins of the port in the mask to the corresponding bits of value.
+static inline void portWrite(uint8_t port, uint8_t mask, uint8_t value)
+{
+  volatile uint8_t * out = portOutputRegister(port);
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    *out = (*out & ~mask) | (value & mask);
+  }
+}
+
+/// Returns the levels of the pins of the port in the mask.
+static inline uint8_t portRead(uint8_t port, uint8_t mask)
+{
+  return *portInputRegister(port) & mask;
+}
+
+/// Makes the pins of the port in the mask outputs.
+static inline void portSetOutput(uint8_t port, uint8_t mask)
+{
+  volatile uint8_t * mode = portModeRegister(port);
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    *mode |= mask;
+  }
+}
+
+/// Makes the pins of the port in the mask inputs.
+static inline void portSetInput(uint8_t port, uint8_t mask)
+{
+  volatile uint8_t * mode = portModeRegister(port);
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    *mode &= ~mask;
+  }
+}
+
+#ifdef __cplusplus
+
+#include "FastPin.h"
+
+namespace PinGroupDetail
+{
+  // The bits of a PinGroup that are on the port whose PINx register is at
+  // I/O address port, for the pins from bit number index on.
+  template <uint8_t port, uint8_t index, uint8_t... pins> struct Port
+  {
+    static const uint8_t mask = 0;
+
+    // Port bit minus value bit for these pins, or noShift if there are none
+    static const int8_t noShift = 100;
+    static const int8_t shift = noShift;
+    static const bool inOrder = true;
+
+    template <class V> __attribute__((always_inline)) static inline uint8_t toPort(V)
+    {
+      return 0;
+    }
+
+    template <class V> __attribute__((always_inline)) static inline V fromPort(uint8_t)
+    {
+      return 0;
+    }
+  };
+
+  template <uint8_t port, uint8_t index, uint8_t pin, uint8_t... rest>
+  struct Port<port, index, pin, rest...>
+  {
+    typedef Port<port, index + 1, rest...> Next;
+
+    static const bool here = FastPin<pin>::pinAddress == port;
+    static const uint8_t bit = FastPin<pin>::bit;
+    static const uint8_t mask = (here ? 1 << bit : 0) | Next::mask;
+
+    static const int8_t noShift = Next::noShift;
+    static const int8_t shift = here ? (int8_t)(bit - index) : Next::shift;
+    static const bool inOrder = Next::inOrder &&
+      (!here || Next::shift == noShift || Next::shift == shift);
+
+    template <class V> __attribute__((always_inline)) static inline uint8_t toPort(V value)
+    {
+      return (here && (value & ((V)1 << index)) ? 1 << bit : 0) | Next::toPort(value);
+    }
+
+    template <class V> __attribute__((always_inline)) static inline V fromPort(uint8_t bits)
+    {
+      return (here && (bits & (1 << bit)) ? (V)1 << index : 0) | Next::template fromPort<V>(bits);
+    }
+  };
+
+  template <bool small> struct Value { typedef uint8_t type; };
+  template <> struct Value<false> { typedef uint16_t type; };
+}
+
+template <uint8_t... pins> class PinGroup
+{
+  static_assert(sizeof...(pins) > 0 && sizeof...(pins) <= 16,
+    "PinGroup: a group has 1 to 16 pins");
+
+public:
+  /// Type of the bus value: uint8_t for up to 8 pins, otherwise uint16_t.
+  typedef typename PinGroupDetail::Value<sizeof...(pins) <= 8>::type Value;
+
+  /// Sets the pins to the bits of value.
+  __attribute__((always_inline)) static inline void write(Value value)
+  {
+    writePort<0x03>(value);  // port B
+    writePort<0x06>(value);  // port C
+    writePort<0x09>(value);  // port D
+    writePort<0x0C>(value);  // port E
+  }
+
+  /// Returns the levels of the pins.
+  __attribute__((always_inline)) static inline Value read()
+  {
+    return readPort<0x03>() | readPort<0x06>() | readPort<0x09>() | readPort<0x0C>();
+  }
+
+  /// Makes all the pins outputs.
+  __attribute__((always_inline)) static inline void setOutput()
+  {
+    setModes<0x03>(true);
+    setModes<0x06>(true);
+    setModes<0x09>(true);
+    setModes<0x0C>(true);
+  }
+
+  /// Makes all the pins inputs.
+  __attribute__((always_inline)) static inline void setInput()
+  {
+    setModes<0x03>(false);
+    setModes<0x06>(false);
+    setModes<0x09>(false);
+    setModes<0x0C>(false);
+  }
+
+private:
+  template <uint8_t port> __attribute__((always_inline)) static inline uint8_t toPort(Value value)
+  {
+    typedef PinGroupDetail::Port<port, 0, pins...> P;
+    if (P::inOrder)
+    {
+      const uint16_t v = value;
+      return (P::shift >= 0 ? v << (P::shift & 15) : v >> (-P::shift & 15)) & P::mask;
+    }
+    return P::toPort(value);
+  }
+
+  template <uint8_t port> __attribute__((always_inline)) static inline void writePort(Value value)
+  {
+    const uint8_t mask = PinGroupDetail::Port<port, 0, pins...>::mask;
+    if (mask == 0) { return; }
+
+    const uint8_t bits = toPort<port>(value);
+    if (mask == 0xFF)
+    {
+      _SFR_IO8(port + 2) = bits;
+      return;
+    }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+      _SFR_IO8(port + 2) = (_SFR_IO8(port + 2) & ~mask) | bits;
+    }
+  }
+
+  template <uint8_t port> __attribute__((always_inline)) static inline Value readPort()
+  {
+    typedef PinGroupDetail::Port<port, 0, pins...> P;
+    if (P::mask == 0) { return 0; }
+
+    const uint8_t bits = _SFR_IO8(port) & P::mask;
+    if (P::inOrder)
+    {
+      return P::shift >= 0 ? bits >> (P::shift & 7) : (uint16_t)bits << (-P::shift & 15);
+    }
+    return P::template fromPort<Value>(bits);
+  }
+
+  template <uint8_t port> __attribute__((always_inline)) static inline void setModes(bool output)
+  {
+    const uint8_t mask = PinGroupDetail::Port<port, 0, pins...>::mask;
+    if (mask == 0) { return; }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+      if (output) { _SFR_IO8(port + 1) |= mask; }
+      else { _SFR_IO8(port + 1) &= ~mask; }
+    }
+  }
+};
+
+#endif
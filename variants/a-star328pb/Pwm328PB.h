@@ -0,0 +1,254 @@
+/* Pwm328PB.h - Hardware PWM on the A-Star 328PB's timer pins, from C or C++.
+ *
+ * analogWrite() looks the pin up in the PROGMEM tables every call, only does
+ * 8-bit duty cycles, and needs the analogWrite328PB() workaround (which C code
+ * does not get) for pin 2.  These functions look a pin up once, in
+ * pwmChannel(), and keep pointers to its timer registers in a PwmChannel, so
+ * changing the duty cycle is a couple of stores:
+ *
+ *   PwmChannel left = pwmChannel(9);
+ *   pwmSetupTimer16(1, PWM_CLOCK_DIV_1, 800);   // 10 kHz at 16 MHz, 0-800
+ *   pwmStart(&left);
+ *   pwmWrite(&left, 400);                        // 50%
+ *
+ * Pin   Timer  Output       Pin   Timer  Output
+ *  0      3    OC3A          6      0    OC0A
+ *  1      4    OC4A          9      1    OC1A
+ *  2      3    OC3B         10      1    OC1B
+ *  3      2    OC2B         11      2    OC2A
+ *  5      0    OC0B
+ *
+ * The timers start the way the Arduino core's init() leaves them: 8-bit,
+ * clock/64, and phase correct except for Timer0 (fast PWM), whose overflow
+ * interrupt runs millis() and must be left alone.  Timers 1, 3 and 4 can be
+ * given any TOP with pwmSetupTimer16() and Timer2 any clock with
+ * pwmSetupTimer2(); the PWM frequency is then
+ *
+ *   F_CPU / (2 * clock divider * TOP)
+ *
+ * and the duty cycle goes from 0 (always low) to TOP (always high).
+ *
+ * Pins 0, 1, 2, 9 and 10 are on the 16-bit Timers 1, 3 and 4, so their TOP can
+ * be anything up to 65535 for up to 16 bits of resolution.
+ * pwmSetupTimer16Frequency() picks the clock and the largest TOP for a given
+ * frequency.  For outputs that must change together, such as the phases of a
+ * motor, give their timers the same clock and TOP, line them up with
+ * pwmSyncTimers16() and set the duty cycles with pwmWriteTogether():
+ *
+ *   uint16_t top = pwmSetupTimer16Frequency(1, 20000);  // 400 at 16 MHz
+ *   pwmSetupTimer16Frequency(3, 20000);
+ *   pwmSetupTimer16Frequency(4, 20000);
+ *   pwmSyncTimers16();
+ *   PwmChannel u = pwmChannel(9), v = pwmChannel(0), w = pwmChannel(1);
+ *   const PwmChannel * phases[] = { &u, &v, &w };
+ *   uint16_t duties[] = { 200, 100, 300 };              // out of top
+ *   pwmWriteTogether(phases, duties, 3);
+ *
+ * All of these timers are run in phase correct mode, in which the hardware
+ * buffers the OCRnx registers and only updates them when the counter reaches
+ * TOP, so writing a new duty cycle at any time does not cause glitches.
+ * Timer0's fast PWM mode is buffered too, but a duty cycle of 0 on pins 5 and
+ * 6 still gives a short pulse every period.  A 16-bit write is two byte
+ * writes through the timer's TEMP register, so an interrupt that writes
+ * 16-bit registers of the same timer must not interrupt pwmWrite() on that
+ * timer.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+/// Clock select (CSn2:0) values for Timers 0, 1, 3 and 4.  Timer2 has its own
+/// set, listed in the datasheet.
+#define PWM_CLOCK_DIV_1     1
+#define PWM_CLOCK_DIV_8     2
+#define PWM_CLOCK_DIV_64    3
+#define PWM_CLOCK_DIV_256   4
+#define PWM_CLOCK_DIV_1024  5
+
+/// Registers of one PWM output.  tccra is 0 for a pin without PWM.
+typedef struct PwmChannel
+{
+  volatile uint8_t * tccra;  // TCCRnA
+  volatile void * ocr;       // OCRnx, 16 bits wide on Timers 1, 3 and 4
+  uint8_t comBit;            // COMnx1 bit mask in TCCRnA
+  uint8_t wide;              // 1 for Timers 1, 3 and 4
+  uint8_t pin;
+} PwmChannel;
+
+/// Returns the PWM output on the given pin.  With a constant pin number this
+/// is worked out by the compiler.
+static inline PwmChannel pwmChannel(uint8_t pin)
+{
+  PwmChannel c = { 0, 0, 0, 0, pin };
+  switch (pin)
+  {
+  case 0:  c.tccra = &TCCR3A; c.ocr = &OCR3A; c.comBit = _BV(COM3A1); c.wide = 1; break;
+  case 1:  c.tccra = &TCCR4A; c.ocr = &OCR4A; c.comBit = _BV(COM4A1); c.wide = 1; break;
+  case 2:  c.tccra = &TCCR3A; c.ocr = &OCR3B; c.comBit = _BV(COM3B1); c.wide = 1; break;
+  case 3:  c.tccra = &TCCR2A; c.ocr = &OCR2B; c.comBit = _BV(COM2B1); break;
+  case 5:  c.tccra = &TCCR0A; c.ocr = &OCR0B; c.comBit = _BV(COM0B1); break;
+  case 6:  c.tccra = &TCCR0A; c.ocr = &OCR0A; c.comBit = _BV(COM0A1); break;
+  case 9:  c.tccra = &TCCR1A; c.ocr = &OCR1A; c.comBit = _BV(COM1A1); c.wide = 1; break;
+  case 10: c.tccra = &TCCR1A; c.ocr = &OCR1B; c.comBit = _BV(COM1B1); c.wide = 1; break;
+  case 11: c.tccra = &TCCR2A; c.ocr = &OCR2A; c.comBit = _BV(COM2A1); break;
+  }
+  return c;
+}
+
+/// Sets the duty cycle, from 0 to the timer's TOP (255 on Timers 0 and 2).
+/// It takes effect when the counter next reaches TOP.
+static inline void pwmWrite(const PwmChannel * c, uint16_t duty)
+{
+  if (c->wide)
+  {
+    *(volatile uint16_t *)c->ocr = duty;
+  }
+  else
+  {
+    *(volatile uint8_t *)c->ocr = duty;
+  }
+}
+
+/// Connects the timer to the pin and makes the pin an output.
+static inline void pwmStart(const PwmChannel * c)
+{
+  uint8_t sreg = SREG;
+  cli();
+  if (c->pin == 2)
+  {
+    // Pin 2 is OC3B and OC4B combined by the output compare modulator.
+    // PORTD2 high selects OR instead of AND, so OC3B alone sets the pin.
+    PORTD |= _BV(2);
+  }
+  *c->tccra = (*c->tccra & ~(c->comBit >> 1)) | c->comBit;
+  if (c->pin < 8) { DDRD |= _BV(c->pin); }
+  else { DDRB |= _BV(c->pin - 8); }
+  SREG = sreg;
+}
+
+/// Disconnects the timer from the pin, which then drives low.
+static inline void pwmStop(const PwmChannel * c)
+{
+  uint8_t sreg = SREG;
+  cli();
+  *c->tccra &= ~c->comBit;
+  if (c->pin < 8) { PORTD &= ~_BV(c->pin); }
+  else { PORTB &= ~_BV(c->pin - 8); }
+  SREG = sreg;
+}
+
+/// Sets up Timer 1, 3 or 4 for phase correct PWM with the given TOP
+/// (3 to 65535) and clock select value.  Outputs already started stay
+/// connected.  The counter is restarted from 0.
+static inline void pwmSetupTimer16(uint8_t timer, uint8_t clock, uint16_t top)
+{
+  volatile uint8_t * tccra = timer == 1 ? &TCCR1A : timer == 3 ? &TCCR3A : &TCCR4A;
+  volatile uint8_t * tccrb = timer == 1 ? &TCCR1B : timer == 3 ? &TCCR3B : &TCCR4B;
+  volatile uint16_t * tcnt = timer == 1 ? &TCNT1 : timer == 3 ? &TCNT3 : &TCNT4;
+  volatile uint16_t * icr = timer == 1 ? &ICR1 : timer == 3 ? &ICR3 : &ICR4;
+
+  uint8_t sreg = SREG;
+  cli();
+  *tccrb = 0;
+  // Mode 10: phase correct PWM, TOP = ICRn, OCRnx updated at TOP.  The bit
+  // positions are the same on all three timers.
+  *tccra = (*tccra & 0xF0) | _BV(WGM11);
+  *icr = top;
+  *tcnt = 0;
+  *tccrb = _BV(WGM13) | clock;
+  SREG = sreg;
+}
+
+/// Sets the clock select value of Timer2, which stays in 8-bit phase correct
+/// PWM mode.  Its values are: 1 clk/1, 2 clk/8, 3 clk/32, 4 clk/64 (the
+/// default), 5 clk/128, 6 clk/256, 7 clk/1024.
+static inline void pwmSetupTimer2(uint8_t clock)
+{
+  uint8_t sreg = SREG;
+  cli();
+  TCCR2A = (TCCR2A & 0xF0) | _BV(WGM20);
+  TCCR2B = clock;
+  SREG = sreg;
+}
+
+/// Sets up Timer 1, 3 or 4 like pwmSetupTimer16(), choosing the smallest
+/// clock divider that reaches the given frequency, which gives the largest
+/// TOP.  Returns the TOP, which is the duty cycle for an always-high output.
+static inline uint16_t pwmSetupTimer16Frequency(uint8_t timer, uint32_t frequency)
+{
+  static const uint16_t dividers[] = { 1, 8, 64, 256, 1024 };
+  uint32_t top = 0;
+  uint8_t clock = 0;
+  while (clock < 5)
+  {
+    top = F_CPU / (2 * dividers[clock++] * frequency);
+    if (top <= 0xFFFF) { break; }
+  }
+  if (top > 0xFFFF) { top = 0xFFFF; }
+  pwmSetupTimer16(timer, clock, top);
+  return top;
+}
+
+/// Restarts Timers 1, 3 and 4 from 0 on the same clock cycle, so timers with
+/// the same clock and TOP reach TOP, and load new duty cycles, together.
+/// Timer0 shares the clock prescaler and stops for the few cycles this takes.
+static inline void pwmSyncTimers16(void)
+{
+  uint8_t sreg = SREG;
+  cli();
+  uint8_t b1 = TCCR1B, b3 = TCCR3B, b4 = TCCR4B;
+
+  // Hold the prescaler in reset so that timers on a divided clock stop, and
+  // stop the timers.
+  GTCCR = _BV(TSM) | _BV(PSRSYNC);
+  TCCR1B = b1 & ~7;
+  TCCR3B = b3 & ~7;
+  TCCR4B = b4 & ~7;
+
+  // A timer on the undivided clock starts counting as soon as its clock is
+  // set, two cycles (one sts) after the previous one, so it starts that far
+  // ahead.
+  TCNT1 = 0;
+  TCNT3 = ((b3 & 7) == PWM_CLOCK_DIV_1) ? 2 : 0;
+  TCNT4 = ((b4 & 7) == PWM_CLOCK_DIV_1) ? 4 : 0;
+  asm volatile(
+    "sts 0x81, %0\n"  // TCCR1B
+    "sts 0x91, %1\n"  // TCCR3B
+    "sts 0xA1, %2\n"  // TCCR4B
+    : : "r" (b1), "r" (b3), "r" (b4));
+
+  // Timers on a divided clock all start now.
+  GTCCR = 0;
+  SREG = sreg;
+}
+
+/// Sets the duty cycles of outputs on Timers 1, 3 and 4 so that they all take
+/// effect at the same TOP.  Their timers need the same clock and TOP and to
+/// have been lined up with pwmSyncTimers16().  This waits, for up to half a
+/// period, until the first output's timer is in the lower half of its count,
+/// then does the writes with interrupts disabled, so they are done before the
+/// timers next reach TOP.  For that, a quarter of the period must be longer
+/// than about 10 cycles per output.
+static inline void pwmWriteTogether(const PwmChannel * const * channels,
+  const uint16_t * duties, uint8_t count)
+{
+  // On these timers TCNTn is 4 bytes after TCCRnA and ICRn is 6 bytes after.
+  volatile uint16_t * tcnt = (volatile uint16_t *)(channels[0]->tccra + 4);
+  uint16_t half = *(volatile uint16_t *)(channels[0]->tccra + 6) / 2;
+  uint8_t sreg = SREG;
+
+  for (;;)
+  {
+    cli();
+    if (*tcnt < half) { break; }
+    SREG = sreg;
+  }
+  for (uint8_t i = 0; i < count; i++)
+  {
+    *(volatile uint16_t *)channels[i]->ocr = duties[i];
+  }
+  SREG = sreg;
+}